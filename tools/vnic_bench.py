@@ -0,0 +1,278 @@
+#!/usr/bin/env python3
+#
+# vnic_bench.py - end-to-end throughput of the VNIC layer, no hardware needed
+#
+#   vnic-gen ns                 init_net               vnic-p<N> ns
+#   +--------+   veth   +--------------------+      +---------+
+#   | vb1    |----------| vb0  (real_dev)    |      | brcm<N> |
+#   +--------+          |   `-- vnic group --+------+---------+
+#    pktgen + tc pedit  +--------------------+
+#
+# RX: pktgen on vb1 sends IPv4 frames, a tc egress pedit turns the ethertype
+# into 0x8874 so they arrive with a bcm53115 style tag whose port byte is the
+# IP TOS.  One pktgen thread per port of the spread.  The inner ethertype is
+# then the IP total length, so the stack drops the frames right after the
+# virtual port counted them: the figures are demux + delivery, not L3.
+#
+# TX: pktgen on each brcm<N> inside its namespace, counted on vb1.
+#
+# Needs root, iproute2 and CONFIG_NET_PKTGEN; results go out as JSON.
+#
+
+import argparse
+import json
+import os
+import platform
+import socket
+import struct
+import subprocess
+import sys
+import time
+
+GEN_NS = "vnic-gen"
+REAL = "vb0"
+PEER = "vb1"
+PREFIX = "brcm"
+
+# rtnetlink, see vnic_netlink.h for the IFLA_VNIC_* attributes
+RTM_NEWLINK = 16
+NLM_F_REQUEST, NLM_F_ACK, NLM_F_EXCL, NLM_F_CREATE = 0x1, 0x4, 0x200, 0x400
+NLMSG_ERROR = 2
+NLA_F_NESTED = 0x8000
+IFLA_IFNAME, IFLA_LINK, IFLA_LINKINFO = 3, 5, 18
+IFLA_INFO_KIND, IFLA_INFO_DATA = 1, 2
+IFLA_VNIC_PORT, IFLA_VNIC_COUNT = 1, 2
+
+
+def sh(cmd, ns=None, check=True):
+    if ns:
+        cmd = "ip netns exec %s %s" % (ns, cmd)
+    res = subprocess.run(cmd, shell=True, capture_output=True, text=True)
+    if check and res.returncode:
+        sys.exit("%s: %s" % (cmd, res.stderr.strip()))
+    return res.stdout
+
+
+def nla(kind, payload):
+    length = 4 + len(payload)
+    return struct.pack("=HH", length, kind) + payload + b"\0" * (-length % 4)
+
+
+def vnic_add(real, name, port, count):
+    """ip link add link <real> name <name> type vnic port <port> count <count>"""
+    data = nla(IFLA_VNIC_PORT, struct.pack("=I", port)) + \
+           nla(IFLA_VNIC_COUNT, struct.pack("=I", count))
+    info = nla(IFLA_INFO_KIND, b"vnic\0") + nla(IFLA_INFO_DATA | NLA_F_NESTED, data)
+    body = struct.pack("=BxHiII", socket.AF_UNSPEC, 0, 0, 0, 0) + \
+           nla(IFLA_IFNAME, name.encode() + b"\0") + \
+           nla(IFLA_LINK, struct.pack("=I", socket.if_nametoindex(real))) + \
+           nla(IFLA_LINKINFO | NLA_F_NESTED, info)
+    flags = NLM_F_REQUEST | NLM_F_ACK | NLM_F_CREATE | NLM_F_EXCL
+    msg = struct.pack("=IHHII", 16 + len(body), RTM_NEWLINK, flags, 1, 0) + body
+
+    with socket.socket(socket.AF_NETLINK, socket.SOCK_RAW, socket.NETLINK_ROUTE) as nl:
+        nl.send(msg)
+        reply = nl.recv(4096)
+
+    _, kind, _, _, _ = struct.unpack_from("=IHHII", reply)
+    err = struct.unpack_from("=i", reply, 16)[0] if kind == NLMSG_ERROR else 0
+    if err:
+        sys.exit("vnic %s: %s" % (name, os.strerror(-err)))
+
+
+def link_stats(dev, ns=None):
+    cmd = "ip -s -j link show dev %s" % dev
+    if ns:
+        cmd = "ip -n %s -s -j link show dev %s" % (ns, dev)
+    stats = json.loads(sh(cmd))[0]["stats64"]
+    return stats["rx"], stats["tx"]
+
+
+def cpu_times():
+    times = []
+    with open("/proc/stat") as f:
+        for line in f:
+            if line.startswith("cpu") and line[3].isdigit():
+                val = [int(v) for v in line.split()[1:]]
+                times.append((sum(val), val[3] + val[4]))     # total, idle + iowait
+    return times
+
+
+def cpu_util(before, after):
+    return [round(100.0 * (1 - (a[1] - b[1]) / max(a[0] - b[0], 1)), 1)
+            for b, a in zip(before, after)]
+
+
+def pg_write(ns, path, cmd):
+    sh("sh -c 'echo \"%s\" > /proc/net/pktgen/%s'" % (cmd, path), ns=ns)
+
+
+def pg_setup(ns, thread, dev, size, dst_mac, extra=()):
+    kthread = "kpktgend_%d" % thread
+    name = "%s@%d" % (dev, thread)
+
+    pg_write(ns, kthread, "rem_device_all")
+    pg_write(ns, kthread, "add_device %s" % name)
+    for cmd in ("count 0", "clone_skb 0", "burst 1", "delay 0",
+                "pkt_size %d" % (size - 4), "dst_mac %s" % dst_mac,
+                "dst_min 198.18.0.2", "dst_max 198.18.0.2",
+                "udp_src_min 9", "udp_src_max 1009", "flag UDPSRC_RND") + tuple(extra):
+        pg_write(ns, name, cmd)
+
+
+def pg_run(ns, duration, sample):
+    """Runs pktgen, returns sample() taken one second in and duration later"""
+    gen = subprocess.Popen("ip netns exec %s sh -c 'echo start > /proc/net/pktgen/pgctrl'" % ns,
+                           shell=True)
+    time.sleep(1)
+    t0, before = time.monotonic(), sample()
+    time.sleep(duration)
+    t1, after = time.monotonic(), sample()
+    pg_write(ns, "pgctrl", "stop")
+    gen.wait()
+
+    return t1 - t0, before, after
+
+
+def pg_clear(ns, threads):
+    for t in threads:
+        pg_write(ns, "kpktgend_%d" % t, "rem_device_all")
+
+
+def port_ns(port):
+    return "vnic-p%d" % port
+
+
+def setup(args):
+    if args.kmod and "vnic" not in sh("lsmod"):
+        sh("insmod %s brcm_chip=bcm53115" % args.kmod)
+    sh("modprobe pktgen")
+
+    sh("ip netns add %s" % GEN_NS)
+    sh("ip link add %s type veth peer name %s netns %s" % (REAL, PEER, GEN_NS))
+    sh("ip link set %s up" % REAL)
+    sh("ip -n %s link set %s up" % (GEN_NS, PEER))
+
+    sh("tc qdisc add dev %s clsact" % PEER, ns=GEN_NS)
+    sh("tc filter add dev %s egress matchall action pedit ex munge eth type set 0x8874" % PEER,
+       ns=GEN_NS)
+
+    vnic_add(REAL, PREFIX + "0", 0, args.ports)
+
+    for port in range(args.ports):
+        dev = "%s%d" % (PREFIX, port)
+        sh("ip netns add %s" % port_ns(port))
+        sh("ip link set %s netns %s" % (dev, port_ns(port)))
+        sh("ip -n %s link set %s up" % (port_ns(port), dev))
+
+
+def teardown(args):
+    for port in range(args.ports):
+        sh("ip netns del %s" % port_ns(port), check=False)
+    sh("ip link del %s" % REAL, check=False)
+    sh("ip netns del %s" % GEN_NS, check=False)
+
+
+def bench_rx(args, size, spread):
+    real_mac = json.loads(sh("ip -j link show dev %s" % REAL))[0]["address"]
+
+    for t in range(spread):
+        pg_setup(GEN_NS, t, PEER, size, real_mac,
+                 ("xmit_mode queue_xmit", "tos %02x" % t))
+
+    def sample():
+        ports = [link_stats("%s%d" % (PREFIX, p), port_ns(p))[0] for p in range(spread)]
+        return ports, link_stats(PEER, GEN_NS)[1], cpu_times()
+
+    dt, before, after = pg_run(GEN_NS, args.duration, sample)
+    pg_clear(GEN_NS, range(spread))
+
+    per_port = [(a["packets"] - b["packets"]) / dt for b, a in zip(before[0], after[0])]
+    rx_bytes = sum(a["bytes"] - b["bytes"] for b, a in zip(before[0], after[0]))
+
+    return {
+        "frame_size": size,
+        "ports": spread,
+        "pps": round(sum(per_port)),
+        "gbps": round(rx_bytes * 8 / dt / 1e9, 3),
+        "offered_pps": round((after[1]["packets"] - before[1]["packets"]) / dt),
+        "port_pps": [round(p) for p in per_port],
+        "cpu_util": cpu_util(before[2], after[2]),
+    }
+
+
+def bench_tx(args, size, spread):
+    peer_mac = json.loads(sh("ip -n %s -j link show dev %s" % (GEN_NS, PEER)))[0]["address"]
+
+    for p in range(spread):
+        pg_setup(port_ns(p), p, "%s%d" % (PREFIX, p), size, peer_mac)
+
+    def sample():
+        ports = [link_stats("%s%d" % (PREFIX, p), port_ns(p))[1] for p in range(spread)]
+        return ports, link_stats(PEER, GEN_NS)[0], cpu_times()
+
+    # One pgctrl per namespace, all but the last run in the background
+    bg = [subprocess.Popen("ip netns exec %s sh -c 'echo start > /proc/net/pktgen/pgctrl'"
+                           % port_ns(p), shell=True) for p in range(1, spread)]
+    dt, before, after = pg_run(port_ns(0), args.duration, sample)
+    for p in range(1, spread):
+        pg_write(port_ns(p), "pgctrl", "stop")
+    for proc in bg:
+        proc.wait()
+    for p in range(spread):
+        pg_clear(port_ns(p), [p])
+
+    rx = after[1]
+
+    return {
+        "frame_size": size,
+        "ports": spread,
+        "pps": round((rx["packets"] - before[1]["packets"]) / dt),
+        "gbps": round((rx["bytes"] - before[1]["bytes"]) * 8 / dt / 1e9, 3),
+        "port_pps": [round((a["packets"] - b["packets"]) / dt)
+                     for b, a in zip(before[0], after[0])],
+        "cpu_util": cpu_util(before[2], after[2]),
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description="VNIC veth/netns/pktgen benchmark")
+    parser.add_argument("--kmod", help="vnic.ko to load if the module is not loaded yet")
+    parser.add_argument("--ports", type=int, default=8, help="virtual ports to create")
+    parser.add_argument("--sizes", default="64,512,1514", help="frame sizes, with FCS")
+    parser.add_argument("--spreads", default="1,4,8", help="numbers of ports to load")
+    parser.add_argument("--duration", type=float, default=5.0, help="seconds per run")
+    parser.add_argument("--output", default="-", help="JSON file, - for stdout")
+    args = parser.parse_args()
+
+    sizes = [int(s) for s in args.sizes.split(",")]
+    spreads = sorted({min(int(s), args.ports, os.cpu_count()) for s in args.spreads.split(",")})
+
+    result = {
+        "kernel": platform.release(),
+        "cpus": os.cpu_count(),
+        "duration": args.duration,
+        "rx": [],
+        "tx": [],
+    }
+
+    teardown(args)
+    setup(args)
+    try:
+        for size in sizes:
+            for spread in spreads:
+                result["rx"].append(bench_rx(args, size, spread))
+                result["tx"].append(bench_tx(args, size, spread))
+    finally:
+        teardown(args)
+
+    out = json.dumps(result, indent=2)
+    if args.output == "-":
+        print(out)
+    else:
+        with open(args.output, "w") as f:
+            f.write(out + "\n")
+
+
+if __name__ == "__main__":
+    main()
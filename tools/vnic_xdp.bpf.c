@@ -0,0 +1,125 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  vnic_xdp.bpf.c
+ *
+ *    Description:  XDP demux of Broadcom tagged frames on the real device
+ *
+ *                  ip link set dev eth0 xdp obj vnic_xdp.bpf.o sec xdp
+ *                  bpftool map update name vnic_ports key 3 0 0 0 value pinned <prog>
+ *
+ *                  The tag is parsed and stripped in the XDP buffer and the program
+ *                  of the ingress port in vnic_ports is tail-called: it sees the
+ *                  frame as its virtual port would and may drop it, redirect it to
+ *                  another virtual port (which tags it again, ndo_xdp_xmit) or pass
+ *                  it.  Passed frames and ports without a program go to the vnic
+ *                  module with the port in the XDP metadata (vnic_xdp.h).  Drivers
+ *                  without metadata support get the frame tagged, as without XDP.
+ *                  With a cascaded switch (brcm_cascade) both tags are taken off and
+ *                  its ports are numbered after those of the first switch.
+ *
+ * =====================================================================================
+ */
+
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+#include "../vnic_xdp.h"
+
+#define BRCM_TAG_LEN        4
+#define BRCM_PREPEND_LEN    8
+#define BRCM_TAG_TYPE       0x8874
+#define BRCM_OPCODE_MASK    0xe0
+
+/* Layouts of the brcm_chip profiles, see vnic_tag.c */
+enum {
+	VNIC_XDP_LAYOUT_TYPE,		/* bcm53101, bcm53115 (default) */
+	VNIC_XDP_LAYOUT_TAG,		/* bcm53125, bcm5301x           */
+	VNIC_XDP_LAYOUT_PREPEND,	/* bcm58xx                      */
+};
+
+/* Set by the loader to match the module's brcm_chip */
+const volatile __u8 vnic_layout = VNIC_XDP_LAYOUT_TYPE;
+const volatile __u8 vnic_port_mask = 0xff;	/* 0x1f for the other layouts */
+const volatile __s16 vnic_cascade = -1;		/* brcm_cascade of the module  */
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PROG_ARRAY);
+	__uint(max_entries, 512);
+	__type(key, __u32);
+	__type(value, __u32);
+} vnic_ports SEC(".maps");
+
+SEC("xdp")
+int vnic_xdp_demux(struct xdp_md *ctx)
+{
+	void *data = (void *)(long)ctx->data;
+	void *data_end = (void *)(long)ctx->data_end;
+	struct vnic_xdp_meta *meta;
+	struct ethhdr *eth = data;
+	__u32 port, tag_len, depth = 1;
+	__u8 *tag;
+
+	if (data + 2 * BRCM_PREPEND_LEN + ETH_HLEN > data_end)
+		return XDP_PASS;
+
+	if (vnic_layout == VNIC_XDP_LAYOUT_PREPEND) {
+		tag = data + BRCM_PREPEND_LEN - BRCM_TAG_LEN;
+		tag_len = BRCM_PREPEND_LEN;
+	} else {
+		tag = data + 2 * ETH_ALEN;
+		tag_len = BRCM_TAG_LEN;
+
+		/* The type takes the first two bytes, the port stays in the last */
+		if (vnic_layout == VNIC_XDP_LAYOUT_TYPE && eth->h_proto != bpf_htons(BRCM_TAG_TYPE))
+			return XDP_PASS;
+	}
+
+	/* Management frames of the switch go to the stack untouched */
+	if (vnic_layout != VNIC_XDP_LAYOUT_TYPE && (tag[0] & BRCM_OPCODE_MASK))
+		return XDP_PASS;
+
+	port = tag[3] & vnic_port_mask;
+
+	/* The first switch put its tag in front of the one of the second */
+	if (vnic_cascade >= 0 && port == vnic_cascade) {
+		tag += tag_len;
+		if (vnic_layout != VNIC_XDP_LAYOUT_TYPE && (tag[0] & BRCM_OPCODE_MASK))
+			return XDP_PASS;
+
+		port = vnic_port_mask + 1 + (tag[3] & vnic_port_mask);
+		depth = 2;
+	}
+
+	/* No metadata, no strip: the module parses the tag itself */
+	if (bpf_xdp_adjust_meta(ctx, -(int)sizeof(*meta)))
+		return XDP_PASS;
+
+	data = (void *)(long)ctx->data;
+	data_end = (void *)(long)ctx->data_end;
+	meta = (void *)(long)ctx->data_meta;
+	if ((void *)(meta + 1) > data || data + 2 * BRCM_PREPEND_LEN + ETH_HLEN > data_end)
+		return XDP_PASS;
+
+	meta->magic = VNIC_XDP_META_MAGIC;
+	meta->port = port;
+
+	if (vnic_layout != VNIC_XDP_LAYOUT_PREPEND) {
+		if (depth == 2)
+			__builtin_memmove(data + 2 * BRCM_TAG_LEN, data, 2 * ETH_ALEN);
+		else
+			__builtin_memmove(data + BRCM_TAG_LEN, data, 2 * ETH_ALEN);
+	}
+
+	/* Moves the metadata along with the start of the frame */
+	if (bpf_xdp_adjust_head(ctx, depth * tag_len))
+		return XDP_DROP;
+
+	bpf_tail_call(ctx, &vnic_ports, port);
+
+	return XDP_PASS;
+}
+
+char _license[] SEC("license") = "GPL";
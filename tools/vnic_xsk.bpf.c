@@ -0,0 +1,41 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  vnic_xsk.bpf.c
+ *
+ *    Description:  AF_XDP consumer of one switch port, zero-copy
+ *
+ *                  Copy mode needs nothing of this: bind the socket to the virtual
+ *                  port (XDP_COPY) and attach an XSKMAP redirect to it, it runs as
+ *                  generic XDP on the port's queues, which mirror the real ones.
+ *
+ *                  Zero-copy has to go through the real device's queues, an xsk
+ *                  only takes frames of the device and queue it is bound to.  Bind
+ *                  the sockets to eth0 queue <q> (XDP_ZEROCOPY), put them in
+ *                  vnic_xsks at <q> and this program in the dispatcher's vnic_ports
+ *                  (vnic_xdp.bpf.c) at the port: the consumer gets that port's
+ *                  frames untagged, everything else takes the usual path.
+ *
+ *                  bpftool map update name vnic_ports key <port> 0 0 0 value pinned <prog>
+ *
+ * =====================================================================================
+ */
+
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+
+struct {
+	__uint(type, BPF_MAP_TYPE_XSKMAP);
+	__uint(max_entries, 64);
+	__type(key, __u32);
+	__type(value, __u32);
+} vnic_xsks SEC(".maps");
+
+SEC("xdp")
+int vnic_xsk_port(struct xdp_md *ctx)
+{
+	/* Queues without a socket pass the frame on to the virtual port */
+	return bpf_redirect_map(&vnic_xsks, ctx->rx_queue_index, XDP_PASS);
+}
+
+char _license[] SEC("license") = "GPL";
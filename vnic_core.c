@@ -20,91 +20,283 @@
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/sched.h>
-#include <linux/if_vnic.h>
 #include <linux/netdevice.h>
-#include <asm/uaccess.h>
+#include <linux/rhashtable.h>
+#include <linux/uaccess.h>
 #include <net/rtnetlink.h>
+#include <net/xdp.h>
 
 #include "vnic_core.h"
 #include "vnic_dev.h"
+#include "vnic_fdb.h"
 #include "vnic_proc.h"
+#include "vnic_sample.h"
+#include "vnic_netlink.h"
 
-static struct hlist_head vnic_group_list_head[VNIC_GRP_LIST_HEAD_LEN];
+#define CREATE_TRACE_POINTS
+#include "vnic_trace.h"
 
-unsigned char vdev_id_priv;
+DEFINE_STATIC_KEY_FALSE(vnic_debug_enabled);
 
-static inline void vnic_grp_list_init(void)
+static int vnic_debug_set(const char *val, const struct kernel_param *kp)
 {
-	unsigned char i;
+	bool enable;
+	int err;
 
-	for (i = 0; i < VNIC_GRP_LIST_HEAD_LEN; i++) {
-		vnic_group_list_head[i].first = NULL;
-	}
+	err = kstrtobool(val, &enable);
+	if (err)
+		return err;
+
+	if (enable)
+		static_branch_enable(&vnic_debug_enabled);
+	else
+		static_branch_disable(&vnic_debug_enabled);
+
+	return 0;
+}
+
+static int vnic_debug_get(char *buffer, const struct kernel_param *kp)
+{
+	return sprintf(buffer, "%c\n", static_key_enabled(&vnic_debug_enabled) ? 'Y' : 'N');
+}
+
+static const struct kernel_param_ops vnic_debug_ops = {
+	.set = vnic_debug_set,
+	.get = vnic_debug_get,
+};
+
+module_param_cb(debug, &vnic_debug_ops, NULL, 0644);
+MODULE_PARM_DESC(debug, "Verbose logging of the data path");
+
+/* Every group, keyed by its real device.  Written under rtnl only */
+static struct rhashtable vnic_groups;
+
+static const struct rhashtable_params vnic_group_params = {
+	.key_len             = sizeof(struct net_device *),
+	.key_offset          = offsetof(struct vnic_group, real_dev),
+	.head_offset         = offsetof(struct vnic_group, node),
+	.automatic_shrinking = true,
+};
+
+/*
+ * Port tables are copied, changed and swapped in, see struct vnic_ports.
+ * The copy has @nr slots, the table grows and shrinks with the ports in use.
+ */
+static struct vnic_ports *vnic_ports_dup(const struct vnic_ports *ports, unsigned int nr, gfp_t gfp)
+{
+	struct vnic_ports *new;
+
+	new = kzalloc(struct_size(new, dev, nr), gfp);
+	if (!new)
+		return NULL;
+
+	new->nr = nr;
+	memcpy(new->dev, ports->dev, min(nr, ports->nr) * sizeof(new->dev[0]));
+
+	return new;
+}
+
+/* Slots still needed once @gone leaves the table */
+static unsigned int vnic_ports_used(const struct vnic_ports *ports, unsigned int gone)
+{
+	unsigned int nr = ports->nr;
+
+	while (nr && (!ports->dev[nr - 1] || nr - 1 == gone))
+		nr--;
 
+	return nr;
 }
 
-static struct vnic_group *vnic_grp_alloc(struct net_device *real_dev, const char *name) 
+static void vnic_ports_publish(struct vnic_group *grp, struct vnic_ports *ports)
 {
+	struct vnic_ports *old = rtnl_dereference(grp->ports);
+
+	rcu_assign_pointer(grp->ports, ports);
+	kfree_rcu(old, rcu);
+}
+
+static struct vnic_group *vnic_grp_alloc(struct net_device *real_dev, const struct vnic_tag_ops *ops) 
+{
+	struct vnic_ports *ports;
 	struct vnic_group *grp;
+	int err = -ENOMEM;
 
 	grp = kzalloc(sizeof(struct vnic_group), GFP_KERNEL);
 	if (!grp)
-		return NULL;
-	
+		return ERR_PTR(-ENOMEM);
+
+	/* Empty, the first port sizes it */
+	ports = kzalloc(sizeof(*ports), GFP_KERNEL);
+	if (!ports)
+		goto err_grp;
+
+	RCU_INIT_POINTER(grp->ports, ports);
 	grp->real_dev = real_dev;
-	
-	if (strcmp("brcm", name)) {
-		printk(KERN_INFO "BROADCOM device.\n");
-		grp->gid = VNIC_GRP_ID_BROADCOM;
+	grp->gid = ops->gid;
+	grp->tag_ops = ops;
+
+	if (static_branch_unlikely(&vnic_fdb_enabled)) {
+		err = vnic_fdb_create(grp);
+		if (err)
+			goto err_ports;
 	}
 
-	hlist_add_head_rcu(&grp->list_node, &vnic_group_list_head[real_dev->ifindex]);
+	err = rhashtable_insert_fast(&vnic_groups, &grp->node, vnic_group_params);
+	if (err) {
+		vnic_fdb_destroy(grp);
+		goto err_ports;
+	}
+
+	/* Tagged frames are taken straight from the real device from now on */
+	err = netdev_rx_handler_register(real_dev, vnic_skb_recv, grp);
+	if (err) {
+		netdev_err(real_dev, "vnic: already has a rx handler\n");
+		rhashtable_remove_fast(&vnic_groups, &grp->node, vnic_group_params);
+		vnic_fdb_destroy(grp);
+		kfree_rcu(ports, rcu);
+		kfree_rcu(grp, rcu);
+		return ERR_PTR(err);
+	}
 
 	return grp;
+
+err_ports:
+	kfree(ports);
+err_grp:
+	kfree(grp);
+	return ERR_PTR(err);
 }
 
-struct vnic_group *vnic_find_grp(struct net_device *virt_dev)
+/*
+ * The group of @real_dev, rtnl must be held.  The rx_handler test keeps the
+ * hash off the notifier for other devices, and a group being released has
+ * given the rx_handler up first: it is not found any more.
+ */
+static struct vnic_group *vnic_grp_get_rtnl(const struct net_device *real_dev)
 {
-	unsigned char vtype = vnic_dev_info(virt_dev)->vtype;
-        unsigned char index = vnic_dev_info(virt_dev)->real_dev->ifindex;
+	if (rcu_access_pointer(real_dev->rx_handler) != vnic_skb_recv)
+		return NULL;
 
-	struct vnic_group *grp;
-	struct hlist_node *n;
+	return rhashtable_lookup_fast(&vnic_groups, &real_dev, vnic_group_params);
+}
 
-	hlist_for_each_entry_rcu(grp, n, &vnic_group_list_head[index], list_node) {
-		if (grp->gid == vtype) {
-			printk(KERN_INFO "This is BROADCOM group.\n");
-			return grp;
-		}
-	}
+struct net_device *vnic_get_port_rtnl(const struct net_device *real_dev, unsigned int vid)
+{
+	struct vnic_group *grp = vnic_grp_get_rtnl(real_dev);
+	struct vnic_ports *ports;
+
+	if (!grp)
+		return NULL;
+
+	ports = rtnl_dereference(grp->ports);
 
-	return NULL;
+	return vid < ports->nr ? ports->dev[vid] : NULL;
 }
 
-struct net_device* vnic_get_dev(int index, int vid)
+/*
+ * Must be called with rtnl held, the virtual devices are queued on @head
+ * and actually unregistered by the caller.  The group must already be out
+ * of vnic_groups.
+ */
+static void vnic_grp_release(void *ptr, void *head)
 {
-	struct vnic_group *grp;
-	struct hlist_node *n;
+	struct vnic_group *grp = ptr;
+	struct vnic_ports *ports = rtnl_dereference(grp->ports);
+	unsigned int i;
+
+	/* No reader left once it returns, the ports then leave the table as is */
+	netdev_rx_handler_unregister(grp->real_dev);
 
-	hlist_for_each_entry_rcu(grp, n, &vnic_group_list_head[index], list_node) {
-		
-		return (grp->brcm_device_array[vid]);
+	for (i = 0; i < ports->nr; i++) {
+		if (ports->dev[i])
+			vnic_port_unregister(ports->dev[i], head);
 	}
 
-	return NULL;
+	vnic_fdb_destroy(grp);
+	kfree_rcu(ports, rcu);
+	kfree_rcu(grp, rcu);
+}
+
+static void vnic_grp_destroy(struct vnic_group *grp, struct list_head *head)
+{
+	rhashtable_remove_fast(&vnic_groups, &grp->node, vnic_group_params);
+	vnic_grp_release(grp, head);
+}
+
+/* Without ports the rx_handler goes, the real device may join a bridge or bond */
+static void vnic_grp_reap(struct vnic_group *grp)
+{
+	if (!rtnl_dereference(grp->ports)->nr)
+		vnic_grp_destroy(grp, NULL);
+}
+
+#if IS_ENABLED(CONFIG_KUNIT)
+/* A group the tests built by hand, found by the control path in between */
+int vnic_grp_kunit_link(struct vnic_group *grp)
+{
+	return rhashtable_insert_fast(&vnic_groups, &grp->node, vnic_group_params);
 }
 
+void vnic_grp_kunit_unlink(struct vnic_group *grp)
+{
+	rhashtable_remove_fast(&vnic_groups, &grp->node, vnic_group_params);
+}
+#endif
+
+#ifdef VNIC_VENDOR_IOCTL
 extern void vnic_ioctl_set (int (*hook) (void __user *));
 
 static int vnic_ioctl_handler (void __user *arg);
 static int vnic_register_vdev (struct net_device *real_dev, char *vdev_name, unsigned char vdev_id, unsigned char vtype);
 static int vnic_unregister_vdev (const char * vdev_name, const unsigned char vdev_id);
+#else
+#define vnic_ioctl_set(hook)
+#endif
+
+/* Follow the offloads of the real device, tear the group down when it goes away */
+static int vnic_device_event(struct notifier_block *unused, unsigned long event, void *ptr)
+{
+	struct net_device *dev = netdev_notifier_info_to_dev(ptr);
+	struct vnic_ports *ports;
+	struct net_device *vdev;
+	struct vnic_group *grp;
+	unsigned int i;
+	LIST_HEAD(list);
 
+	grp = vnic_grp_get_rtnl(dev);
+	if (!grp)
+		return NOTIFY_DONE;
+
+	switch (event) {
+		case NETDEV_FEAT_CHANGE:
+			ports = rtnl_dereference(grp->ports);
+			for (i = 0; i < ports->nr; i++) {
+				vdev = ports->dev[i];
+				if (vdev)
+					netdev_update_features(vdev);
+			}
+			break;
+
+		case NETDEV_XDP_FEAT_CHANGE:
+			ports = rtnl_dereference(grp->ports);
+			for (i = 0; i < ports->nr; i++) {
+				vdev = ports->dev[i];
+				if (vdev)
+					xdp_set_features_flag(vdev, dev->xdp_features & VNIC_XDP_FEATURES);
+			}
+			break;
 
-static struct packet_type vnic_packet_type __read_mostly = {
-	.type           = cpu_to_be16(0x8874),
-	.func           = vnic_skb_recv,
-	.af_packet_priv = &vdev_id_priv,
+		case NETDEV_UNREGISTER:
+			vnic_grp_destroy(grp, &list);
+			unregister_netdevice_many(&list);
+			break;
+	}
+
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block vnic_notifier_block __read_mostly = {
+	.notifier_call = vnic_device_event,
 };
 
 /* 
@@ -116,11 +308,43 @@ static struct packet_type vnic_packet_type __read_mostly = {
 static int __init
 vnic_module_init (void)
 {
+	int err;
+
+	err = vnic_tag_init();
+	if (err < 0)
+		return err;
+
 	vnic_proc_init();
 
-	vnic_grp_list_init();
+	vnic_flood_init();
+
+	vnic_rx_init();
+
+	vnic_fdb_init();
+
+	err = rhashtable_init(&vnic_groups, &vnic_group_params);
+	if (err < 0) {
+		vnic_proc_cleanup();
+		vnic_tag_fini();
+		return err;
+	}
+
+	err = register_netdevice_notifier(&vnic_notifier_block);
+	if (err < 0) {
+		rhashtable_destroy(&vnic_groups);
+		vnic_proc_cleanup();
+		vnic_tag_fini();
+		return err;
+	}
 
-	dev_add_pack(&vnic_packet_type);
+	err = vnic_netlink_init();
+	if (err < 0) {
+		unregister_netdevice_notifier(&vnic_notifier_block);
+		rhashtable_destroy(&vnic_groups);
+		vnic_proc_cleanup();
+		vnic_tag_fini();
+		return err;
+	}
 
 	vnic_ioctl_set(vnic_ioctl_handler);
 	return 0;
@@ -138,37 +362,44 @@ vnic_module_init (void)
 static void __exit
 vnic_module_exit (void)
 {
-	int i;
+	LIST_HEAD(list);
+
+	vnic_ioctl_set(NULL);
+
+	/* Deletes every port through vnic_link_ops.dellink */
+	vnic_netlink_fini();
 
-	i = VNIC_GRP_LIST_HEAD_LEN;
+	unregister_netdevice_notifier(&vnic_notifier_block);
+
+	rtnl_lock();
+
+	/* The notifier is gone, nothing else touches the table any more */
+	rhashtable_free_and_destroy(&vnic_groups, vnic_grp_release, &list);
+
+	unregister_netdevice_many(&list);
+
+	rtnl_unlock();
+
+	vnic_flood_fini();
+
+	vnic_tag_fini();
+
+	/* Wait for the groups queued by kfree_rcu() */
+	rcu_barrier();
 
 	vnic_proc_cleanup();
-	
-	dev_remove_pack(&vnic_packet_type);
-
-  	while(i) {
-        
-		if (!hlist_empty(&vnic_group_list_head[i])) {
-	
-			struct vnic_group *grp;
-			struct hlist_node *n, *m;
-
-			hlist_for_each_entry_safe(grp, n, m, &vnic_group_list_head[i], list_node) {
-				kfree(grp);
-			}
-		}
 
-		--i;
-	}
-	
+	vnic_sample_fini();
 }
 
 /* -----  end of function vnic_module_exit  ----- */
 
+#ifdef VNIC_VENDOR_IOCTL
 static int vnic_ioctl_handler(void __user *arg)
 {
 	struct vnic_ioctl_args args;
 	struct net_device *dev = NULL;
+	int err;
 
 	if (copy_from_user(&args, arg, sizeof(struct vnic_ioctl_args)))
 		return -EFAULT;
@@ -177,93 +408,257 @@ static int vnic_ioctl_handler(void __user *arg)
 
 	switch (args.cmd) {
 		case ADD_BRCM_CMD:
-			dev = dev_get_by_name(args.real_dev);
+			dev = __dev_get_by_name(&init_net, args.real_dev);
 
 			if (!dev) {
+				rtnl_unlock();
 				return -ENODEV;
 			}
 
-			printk("real dev :%s \n",dev->name);
-			printk("virt dev :%s \n",args.virt_dev);
-			printk("vid : %d \n", args.vdev_id);
+			vnic_dbg("vnic: add %s%u on %s.\n", args.virt_dev, args.vdev_id, dev->name);
 
-			vnic_register_vdev (dev, args.virt_dev, args.vdev_id, VNIC_GRP_ID_BROADCOM);
+			err = vnic_register_vdev (dev, args.virt_dev, args.vdev_id, VNIC_GRP_ID_BROADCOM);
 			
 			break;
 
 		case DEL_BRCM_CMD:
-			printk("virt dev :%s \n",args.virt_dev);
-			printk("vid : %d \n", args.vdev_id);
+			vnic_dbg("vnic: delete %s%u.\n", args.virt_dev, args.vdev_id);
 
-			vnic_unregister_vdev (args.virt_dev, args.vdev_id);
+			err = vnic_unregister_vdev (args.virt_dev, args.vdev_id);
 			break;
 		default:
-			printk(KERN_WARNING "This virtual device is not supported.\n");
+			rtnl_unlock();
+			vnic_dbg("vnic: unknown ioctl command %d.\n", args.cmd);
 			return -ENODEV;
 	}
 
 	rtnl_unlock();
-	return 0;
+	return err;
 }
+#endif
 
 
 /* 
  * ===  FUNCTION  ======================================================================
- *         Name:  vnic_register_vdev
- *  Description:  
+ *         Name:  vnic_port_register
+ *  Description:  Register an allocated virtual device on port @vdev_id of @real_dev
+ *                and publish it in the group.  Shared by the ioctl and the rtnetlink
+ *                paths, rtnl must be held.
  * =====================================================================================
  */
 int
-vnic_register_vdev (struct net_device *real_dev, char *vdev_name, unsigned char vdev_id, unsigned char vtype)
+vnic_port_register (struct net_device *real_dev, struct net_device *new_dev, unsigned int vdev_id, unsigned char vtype)
 {
-	struct net_device *new_dev;
+	const struct vnic_tag_ops *ops;
+	struct vnic_ports *ports;
 	struct vnic_group *grp;
-	unsigned char name[IFNAMSIZ];
 	int err;
 
-	vdev_id_priv = vdev_id;
+	ops = vnic_tag_ops_get(vtype);
+	if (!ops)
+		return -EPROTONOSUPPORT;
 
-	sprintf(name, "%s%d", vdev_name, vdev_id);
-	printk("name : %s \n", name);
+	if (vdev_id >= ops->max_ports)
+		return -EINVAL;
 
-	new_dev = alloc_netdev(sizeof(struct vnic_device), name, vnic_netdev_setup);
+	/* Add in vnic_groups */
+	grp = vnic_grp_get_rtnl(real_dev);
+	if (!grp) {
+		grp = vnic_grp_alloc(real_dev, ops);
+		if (IS_ERR(grp))
+			return PTR_ERR(grp);
+		vnic_dbg("vnic: create %s group for %s.\n", ops->name, grp->real_dev->name);
+	}
 
-	if (!new_dev)
-		return -ENODEV;
+	/* One rx_handler per real device, so one tag format as well */
+	if (grp->tag_ops != ops)
+		return -EBUSY;
 
 	vnic_dev_info(new_dev)->real_dev = real_dev;
 	vnic_dev_info(new_dev)->vid = vdev_id;
 	vnic_dev_info(new_dev)->vtype = vtype;
+	vnic_dev_info(new_dev)->tag_ops = ops;
 
-	strcpy(new_dev->dev_addr, real_dev->dev_addr);
+	ports = rtnl_dereference(grp->ports);
+	if (vdev_id < ports->nr && ports->dev[vdev_id])
+		return -EEXIST;
 
-	printk(KERN_INFO "vnic: real dev ifindex is %d.\n", real_dev->ifindex);
+	/* Prepared first, publishing the port can not fail */
+	ports = vnic_ports_dup(ports, max(ports->nr, vdev_id + 1), GFP_KERNEL);
+	if (!ports) {
+		err = -ENOMEM;
+		goto err_reap;
+	}
 
 	err = register_netdevice(new_dev);
-	if (err < 0)
-		goto out_free_newdev;
+	if (err < 0) {
+		kfree(ports);
+		goto err_reap;
+	}
 
 	err = vnic_proc_add_dev(new_dev);
 	if (err < 0)
-		printk(KERN_WARNING "vnic: failed to add proc entry for %s.\n", new_dev->name);
+		netdev_warn(new_dev, "vnic: failed to add proc entry\n");
 
-        /* Add in vnic_group_list */
-	grp = vnic_find_grp(new_dev);
-	if (!grp) {
-		grp = vnic_grp_alloc(real_dev, vdev_name);
-		printk(KERN_INFO "Create vnic group for %s.\n", grp->real_dev->name);
-	}
-	grp->brcm_device_array[vdev_id] = new_dev;
+	ports->dev[vdev_id] = new_dev;
+	vnic_ports_publish(grp, ports);
+
+	vnic_dbg("vnic: Add %s in the %s group.\n", new_dev->name, real_dev->name);
 
-	printk(KERN_INFO "vnic: Add %s in VNIC_GROUP_LIST.\n", new_dev->name);
-	
 	return 0;
 
-out_free_newdev:
-	free_netdev(new_dev);
+err_reap:
+	/* The group may have been made for this port */
+	vnic_grp_reap(grp);
 	return err;
 }
 
+/* -----  end of function vnic_port_register  ----- */
+
+
+/* 
+ * ===  FUNCTION  ======================================================================
+ *         Name:  vnic_port_unregister
+ *  Description:  Take a virtual device out of its group and queue it on @head, or
+ *                unregister it right away when @head is NULL.  rtnl must be held.
+ * =====================================================================================
+ */
+void
+vnic_port_unregister (struct net_device *dev, struct list_head *head)
+{
+	struct vnic_device *vdev = vnic_dev_info(dev);
+	struct vnic_ports *ports;
+	struct vnic_group *grp;
+
+	vnic_proc_rem_dev(dev);
+
+	grp = vnic_grp_get_rtnl(vdev->real_dev);
+	ports = grp ? rtnl_dereference(grp->ports) : NULL;
+	if (ports && vdev->vid < ports->nr && ports->dev[vdev->vid] == dev) {
+		/* Small and the device goes away regardless */
+		ports = vnic_ports_dup(ports, vnic_ports_used(ports, vdev->vid), GFP_KERNEL | __GFP_NOFAIL);
+		if (vdev->vid < ports->nr)
+			ports->dev[vdev->vid] = NULL;
+		vnic_ports_publish(grp, ports);
+		vnic_fdb_flush_port(grp, vdev->vid);
+		vnic_grp_reap(grp);
+	}
+
+	/* unregister_netdevice() waits for the readers of the old table */
+	unregister_netdevice_queue(dev, head);
+}
+
+/* -----  end of function vnic_port_unregister  ----- */
+
+
+/* 
+ * ===  FUNCTION  ======================================================================
+ *         Name:  vnic_port_move
+ *  Description:  Move a virtual device to switch port @vdev_id of the same switch,
+ *                e.g. on failover.  Its frames are delivered from the old port until
+ *                the new table is published and from the new port after, none is
+ *                lost in between.  rtnl must be held.
+ * =====================================================================================
+ */
+int
+vnic_port_move (struct net_device *dev, unsigned int vdev_id)
+{
+	struct vnic_device *vdev = vnic_dev_info(dev);
+	unsigned int old_id = vdev->vid;
+	struct vnic_ports *ports;
+	struct vnic_group *grp;
+
+	if (vdev_id == old_id)
+		return 0;
+
+	grp = vnic_grp_get_rtnl(vdev->real_dev);
+	if (!grp)
+		return -ENODEV;
+
+	if (vdev_id >= grp->tag_ops->max_ports)
+		return -ERANGE;
+
+	ports = rtnl_dereference(grp->ports);
+	if (vdev_id < ports->nr && ports->dev[vdev_id])
+		return -EEXIST;
+
+	ports = vnic_ports_dup(ports, max(vnic_ports_used(ports, old_id), vdev_id + 1), GFP_KERNEL);
+	if (!ports)
+		return -ENOMEM;
+
+	if (old_id < ports->nr)
+		ports->dev[old_id] = NULL;
+	ports->dev[vdev_id] = dev;
+	vnic_ports_publish(grp, ports);
+
+	/* Egress follows right after, the learnt addresses of the old port go */
+	WRITE_ONCE(vdev->vid, vdev_id);
+	vnic_dev_build_tags(dev);
+	vnic_fdb_flush_port(grp, old_id);
+
+	return 0;
+}
+
+/* -----  end of function vnic_port_move  ----- */
+
+
+/* 
+ * ===  FUNCTION  ======================================================================
+ *         Name:  vnic_port_create
+ *  Description:  Allocate and register the virtual device @vdev_name<vdev_id> in @net
+ * =====================================================================================
+ */
+struct net_device *
+vnic_port_create (struct net *net, struct net_device *real_dev, const char *vdev_name, unsigned int vdev_id, unsigned char vtype)
+{
+	struct net_device *new_dev;
+	char name[IFNAMSIZ];
+	int err;
+
+	if (snprintf(name, IFNAMSIZ, "%s%u", vdev_name, vdev_id) >= IFNAMSIZ)
+		return ERR_PTR(-EINVAL);
+
+	/* One queue per real device queue, see vnic_dev_select_queue() */
+	new_dev = alloc_netdev_mqs(sizeof(struct vnic_device), name, NET_NAME_USER, vnic_netdev_setup,
+				   real_dev->num_tx_queues, real_dev->num_rx_queues);
+
+	if (!new_dev)
+		return ERR_PTR(-ENOMEM);
+
+	dev_net_set(new_dev, net);
+
+	err = vnic_port_register(real_dev, new_dev, vdev_id, vtype);
+	if (err < 0) {
+		free_netdev(new_dev);
+		return ERR_PTR(err);
+	}
+
+	return new_dev;
+}
+
+/* -----  end of function vnic_port_create  ----- */
+
+#ifdef VNIC_VENDOR_IOCTL
+/* 
+ * ===  FUNCTION  ======================================================================
+ *         Name:  vnic_register_vdev
+ *  Description:  
+ * =====================================================================================
+ */
+int
+vnic_register_vdev (struct net_device *real_dev, char *vdev_name, unsigned char vdev_id, unsigned char vtype)
+{
+	struct net_device *new_dev;
+
+	new_dev = vnic_port_create(&init_net, real_dev, vdev_name, vdev_id, vtype);
+	if (IS_ERR(new_dev))
+		return PTR_ERR(new_dev);
+
+	vnic_dbg("vnic: Add %s on %s.\n", new_dev->name, real_dev->name);
+
+	return 0;
+}
+
 /* -----  end of function vnic_register_vdev  ----- */
 
 
@@ -277,37 +672,29 @@ int
 vnic_unregister_vdev (const char * vdev_name, const unsigned char vdev_id)
 {
 	struct net_device *dev = NULL;
-	struct vnic_group *grp;
-	unsigned char name[IFNAMSIZ];
-
-	sprintf(name, "%s%d", vdev_name, vdev_id);
-	dev = dev_get_by_name(name);
+	char name[IFNAMSIZ];
 
-	if (dev) {
+	snprintf(name, IFNAMSIZ, "%s%d", vdev_name, vdev_id);
+	dev = __dev_get_by_name(&init_net, name);
 
-		vnic_proc_rem_dev(dev);
+	if (dev && is_vnic_dev(dev)) {
 
-		dev_put(dev);
-
-		grp = vnic_find_grp(dev);
-		if (grp)
-			grp->brcm_device_array[vdev_id] = NULL;
-		
-		unregister_netdevice(dev);
+		vnic_port_unregister(dev, NULL);
 
 	}else {
-		dev_put(dev);
-		printk(KERN_ERR "Could not find this virtual device.\n");
+		vnic_dbg("vnic: no virtual device %s.\n", name);
 		return -ENODEV;
 	}
 
 	return 0;
 }	
 
-/* -----  end of function vnic_register_vdev  ----- */
+/* -----  end of function vnic_unregister_vdev  ----- */
 
+#endif /* VNIC_VENDOR_IOCTL */
 
 module_init(vnic_module_init);
 module_exit(vnic_module_exit);
 
-
+MODULE_LICENSE("GPL");
+MODULE_ALIAS_RTNL_LINK("vnic");
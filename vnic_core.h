@@ -3,54 +3,82 @@
 #define __VNIC_CORE_INC__
 
 #include <linux/netdevice.h>
+#include <linux/jump_label.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/rhashtable-types.h>
+#include <net/gro_cells.h>
+
+#include "vnic_tag.h"
+#include "vnic_netlink.h"
+
+/*
+ *  The vendor kernel has <linux/if_vnic.h>: the IFF_VNIC private flag and
+ *  the ioctl hook of the vnic tool.  Other kernels, e.g. the UML one KUnit
+ *  builds, have neither and the ports are created through rtnetlink only.
+ */
+#if __has_include(<linux/if_vnic.h>)
 #include <linux/if_vnic.h>
+#define VNIC_VENDOR_IOCTL
+#else
+#define IFF_VNIC 0
+#endif
+
+/*
+ *  Verbose logging, switched at runtime with the "debug" module parameter.
+ *  It is a patched-out branch while disabled.
+ */
+DECLARE_STATIC_KEY_FALSE(vnic_debug_enabled);
 
-#define BROADCOM
-#define VNIC_PROC_DEBUG
+#define vnic_dbg(fmt, ...)						\
+	do {								\
+		if (static_branch_unlikely(&vnic_debug_enabled))	\
+			printk(KERN_INFO fmt, ##__VA_ARGS__);		\
+	} while (0)
 
 
 /*  
- *  OpenVNIC use several list to manage the virtual device.
+ *  OpenVNIC keeps one vnic_group per real device in a resizable hash table
+ *  keyed by the real device, each group points at a port table sized to
+ *  the switch chip behind it.
  *
- *  vnic_group_list            vnic_group               vnic_group
+ *  vnic_groups                vnic_group               vnic_group
  *  ----------------       ------------------       ------------------
- *  |  hlist_head  |------>|      hlist     |------>|      hlist     |
+ *  |  rhashtable  |------>|   rhash_head   |------>|   rhash_head   |
  *  ----------------       ------------------       ------------------
- *  |  hlist_head  |----   |      eth0      |       |      eth0      |
- *  ----------------   |    ------------------       -----------------       -----------
- *  |    ......    |   |   | brcm_dev_array |       |  ar_dev_array  |------>|   ar0   |
- *  ----------------   |   ------------------       ------------------       -----------
- *                     |                                                     |   ar1   |
- *                     |   ------------------                                -----------
- *                     --->|      hlist     |                                |   ar2   |
- *                         ------------------                                -----------
- *                         |      eth1      |                                |   ...   |
- *                         ------------------       -----------              -----------
- *                         | brcm_dev_array |------>|  brcm0  |
- *                         ------------------       -----------
- *                                                  |  brcm1  |
- *                                                  -----------
- *                                                  |  brcm2  |
- *                                                  -----------
+ *                         |      eth0      |       |      eth1      |
+ *                         ------------------       ------------------       -----------
+ *                         |     ports      |--     |     ports      |------>|  brcm0  |
+ *                         ------------------  |    ------------------       -----------
+ *                                             |                             |  brcm1  |
+ *                                             |    -----------              -----------
+ *                                             ---->|   ar0   |              |   ...   |
+ *                                                  -----------              -----------
+ *                                                  |   ar1   |              | brcm255 |
+ *                                                  -----------              -----------
  *                                                  |   ...   |
  *                                                  -----------
  *                                                
  */
 
 
-#define VNIC_GRP_LIST_HEAD_LEN   5
 #define VNIC_GRP_ID_BROADCOM     0
 #define VNIC_GRP_ID_ATHEROS      1
 
-
-#ifdef BROADCOM
-
-#define BCM53101
-#define BCM53115
-
-#define BRCM_TAG_LEN             4
-
-#endif /* BROADCOM */
+/*
+ *  Per-CPU counters of a virtual device, only folded together when the
+ *  stack asks for them through ndo_get_stats64.
+ */
+struct vnic_pcpu_stats {
+	u64_stats_t rx_packets;
+	u64_stats_t rx_bytes;
+	u64_stats_t rx_multicast;
+	u64_stats_t tx_packets;
+	u64_stats_t tx_bytes;
+	struct u64_stats_sync syncp;
+	u32 rx_dropped;
+	u32 tx_dropped;
+	u32 sample_skip;	/* frames left to the next sample */
+};
 
 struct vnic_device {
 	struct net_device *real_dev;
@@ -58,24 +86,52 @@ struct vnic_device {
 	unsigned char vtype;
 	struct proc_dir_entry *dent;
 
-#ifdef BROADCOM
-	struct net_device_stats *brcm_rx_stats;
-#endif
+	struct vnic_pcpu_stats __percpu *vnic_pcpu_stats;
+	struct gro_cells gro_cells;
+
+	const struct vnic_tag_ops *tag_ops;	/* same as the group's          */
+	u64 tx_tag;				/* egress tag, built in ndo_init */
 
+	/*
+	 * QoS: skb->priority picks the egress tag, with the switch traffic
+	 * class set from the mqprio map of the port.  Without a priority
+	 * from the stack it may come from the DSCP.
+	 */
+	u8 prio_tc[TC_BITMASK + 1];
+	u64 prio_tag[TC_BITMASK + 1];
+	bool dscp_map;
+	u8 dscp_prio[64];
+
+	u32 sample_rate;			/* 1 in N, 0 is off, vnic_sample.h */
+};
+
+/*
+ *  The group is also the rx_handler_data of its real device, so the receive
+ *  path reaches the port table with a single dependent load and never looks
+ *  at vnic_groups.  The hash table is only used on the control path.
+ *
+ *  The port table reaches the highest configured port and no further, a
+ *  port the switch reports beyond it is dropped by vnic_get_dev().  The
+ *  group goes with its last port, returning the real device's rx_handler.  A
+ *  published table is never written: a change builds a copy and swaps the
+ *  pointer, readers see either table whole and the old one is freed after
+ *  a grace period.
+ */
+struct vnic_ports {
+	unsigned int nr;
+	struct rcu_head rcu;
+	struct net_device *dev[];
 };
 
 struct vnic_group {
-	struct hlist_node list_node;
+	const struct vnic_tag_ops *tag_ops;
+	struct vnic_ports __rcu *ports;
+	struct vnic_fdb *fdb;			/* NULL without fdb_fastpath */
+	struct rhash_head node;
 	struct net_device *real_dev;
-        unsigned char gid;
-#ifdef BROADCOM
-	struct net_device *brcm_device_array[BRCM_GROUP_ARRAY_LEN];
-#endif
-
-#ifdef ATHEROS
-	struct net_device *ar_device_array[AR_GROUP_ARRAY_LEN];
-#endif
-};
+	unsigned char gid;
+	struct rcu_head rcu;
+} ____cacheline_aligned;
 
 
 static inline struct vnic_device* vnic_dev_info(struct net_device *dev)
@@ -85,10 +141,67 @@ static inline struct vnic_device* vnic_dev_info(struct net_device *dev)
 
 static inline int is_vnic_dev(struct net_device *dev)
 {
+#ifdef VNIC_VENDOR_IOCTL
 	return dev->priv_flags & IFF_VNIC;
+#else
+	return dev->rtnl_link_ops == &vnic_link_ops;
+#endif
+}
+
+static inline void
+vnic_rx_stats_add (struct net_device *dev, unsigned int len, bool multicast)
+{
+	struct vnic_pcpu_stats *stats = this_cpu_ptr(vnic_dev_info(dev)->vnic_pcpu_stats);
+
+	u64_stats_update_begin(&stats->syncp);
+	u64_stats_inc(&stats->rx_packets);
+	u64_stats_add(&stats->rx_bytes, len);
+	if (multicast)
+		u64_stats_inc(&stats->rx_multicast);
+	u64_stats_update_end(&stats->syncp);
 }
 
-struct vnic_group *vnic_find_grp(struct net_device *virt_dev);
-struct net_device* vnic_get_dev(int index, int vid);
+static inline void
+vnic_tx_stats_bulk_add (struct net_device *dev, unsigned int packets, u64 len)
+{
+	struct vnic_pcpu_stats *stats = this_cpu_ptr(vnic_dev_info(dev)->vnic_pcpu_stats);
+
+	u64_stats_update_begin(&stats->syncp);
+	u64_stats_add(&stats->tx_packets, packets);
+	u64_stats_add(&stats->tx_bytes, len);
+	u64_stats_update_end(&stats->syncp);
+}
+
+static inline void
+vnic_tx_stats_add (struct net_device *dev, unsigned int len)
+{
+	vnic_tx_stats_bulk_add(dev, 1, len);
+}
+
+/*
+ * Called from the rx_handler under rcu_read_lock(), the group is taken
+ * from the real device's rx_handler_data.
+ */
+static inline struct net_device* vnic_get_dev(const struct vnic_group *grp, unsigned int vid)
+{
+	const struct vnic_ports *ports = rcu_dereference(grp->ports);
+
+	if (unlikely(vid >= ports->nr))
+		return NULL;
+
+	return ports->dev[vid];
+}
+
+struct net_device *vnic_get_port_rtnl(const struct net_device *real_dev, unsigned int vid);
+
+int vnic_port_register(struct net_device *real_dev, struct net_device *new_dev, unsigned int vdev_id, unsigned char vtype);
+void vnic_port_unregister(struct net_device *dev, struct list_head *head);
+int vnic_port_move(struct net_device *dev, unsigned int vdev_id);
+struct net_device *vnic_port_create(struct net *net, struct net_device *real_dev, const char *vdev_name, unsigned int vdev_id, unsigned char vtype);
+
+#if IS_ENABLED(CONFIG_KUNIT)
+int vnic_grp_kunit_link(struct vnic_group *grp);
+void vnic_grp_kunit_unlink(struct vnic_group *grp);
+#endif
 
 #endif /* __VNIC_CORE_INC__  */
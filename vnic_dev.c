@@ -18,156 +18,518 @@
 #include <linux/netdevice.h>
 #include <linux/etherdevice.h>
 #include <linux/if_ether.h>
-#include <proto/ethernet.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/jhash.h>
+#include <net/dsfield.h>
+#include <net/pkt_sched.h>
+#include <net/xdp.h>
 
 #include "vnic_core.h"
 #include "vnic_dev.h"
+#include "vnic_fdb.h"
+#include "vnic_netlink.h"
+#include "vnic_sample.h"
+#include "vnic_trace.h"
+#include "vnic_xdp.h"
 
-#ifdef BROADCOM
+/*
+ *  Offloads a virtual device may take over from its real device.  The tag
+ *  is inserted like a VLAN header, so the real device's vlan_features tell
+ *  what still works behind it.  Software GSO is always advertised: frames
+ *  are segmented as late as on the real device, after the tag has been
+ *  inserted, so every segment carries it.
+ */
+#define VNIC_FEATURES (NETIF_F_SG | NETIF_F_CSUM_MASK | NETIF_F_HIGHDMA | \
+		       NETIF_F_FRAGLIST | NETIF_F_GSO_SOFTWARE | NETIF_F_RXCSUM)
 
-/* 
- * ===  FUNCTION  ======================================================================
- *         Name:  vnic_get_brcm_port
- *  Description:  
- * =====================================================================================
+/* Port left in the metadata by the XDP dispatcher, -1 for a tagged frame */
+static __always_inline int
+vnic_xdp_meta_port (const struct sk_buff *skb)
+{
+	const struct vnic_xdp_meta *meta;
+
+	if (likely(skb_metadata_len(skb) != sizeof(*meta)))
+		return -1;
+
+	meta = (const struct vnic_xdp_meta *)(skb_metadata_end(skb) - sizeof(*meta));
+
+	return meta->magic == VNIC_XDP_META_MAGIC ? meta->port : -1;
+}
+
+/*
+ *  Software RSS.  Uplinks to the switch are mostly single queue and the
+ *  real device hashed the tagged frame, if at all, so the frames of every
+ *  port come with one hash.  With rx_hash the hash is taken again on the
+ *  untagged frame, over the inner flow, and mixed with the port.  With
+ *  rx_steer the frames go through netif_rx(), where the RPS map of the
+ *  port (queues/rx-N/rps_cpus, RFS with rps_flow_cnt) picks the CPU that
+ *  runs the stack for them.
  */
+static DEFINE_STATIC_KEY_FALSE(vnic_rx_hash);
+static DEFINE_STATIC_KEY_FALSE(vnic_rx_steer);
+
+static bool rx_hash = true;
+module_param(rx_hash, bool, 0444);
+MODULE_PARM_DESC(rx_hash, "Hash received frames over their inner flow and switch port");
 
-static unsigned char
-vnic_get_brcm_port (struct sk_buff *skb)
+static bool rx_steer;
+module_param(rx_steer, bool, 0444);
+MODULE_PARM_DESC(rx_steer, "Hand received frames to the CPUs of the port's RPS map before the stack");
+
+static __always_inline void
+vnic_rx_set_hash (struct sk_buff *skb, unsigned int port)
 {
-	const struct brcm_header *pb;
-	unsigned char port;
-	
-	pb = (struct brcm_header *)skb->data;
-	
-	port = ((char*)(&(pb->brcm_tag)))[3];
-
-	return port;
-}	
+	u32 hash;
 
-/* -----  end of function vnic_get_brcm_port  ----- */
+	skb_clear_hash(skb);
+	hash = skb_get_hash(skb);
+
+	__skb_set_sw_hash(skb, jhash_1word(hash, port), skb->l4_hash);
+}
+
+void
+vnic_rx_init (void)
+{
+	if (rx_hash || rx_steer)
+		static_branch_enable(&vnic_rx_hash);
+
+	if (rx_steer)
+		static_branch_enable(&vnic_rx_steer);
+}
 
 /* 
  * ===  FUNCTION  ======================================================================
- *         Name:  vnic_skb_rebuild
- *  Description:  Remove the brcm tag which added by switch chip before send the skb to
- *                IP layer
+ *         Name:  vnic_skb_recv
+ *  Description:  rx_handler of the real device, called under rcu_read_lock() with
+ *                rx_handler_data pointing at the vnic_group of the real device.
+ *
+ *                The frame is retargeted and handed back to the core with
+ *                RX_HANDLER_ANOTHER, still in the NAPI poll of the real device: when
+ *                the real driver receives a NAPI burst through netif_receive_skb_list()
+ *                or GRO, the demuxed frames stay in that list and reach the protocol
+ *                handlers as sublists instead of one backlog round trip per frame.
+ *                The skb keeps the NAPI ID of the real device, so sockets on the
+ *                virtual device busy poll the real device's queue.  That is also
+ *                where generic XDP programs of the virtual device run.
+ *
+ *                Only frames the real device could not coalesce, a tag its GRO does
+ *                not look through, go to the gro_cells of the virtual device when
+ *                it has GRO enabled.  Turning GRO off on the port gives the direct
+ *                path to every frame.
+ *
+ *                Frames the XDP dispatcher on the real device already stripped carry
+ *                their port in the XDP metadata.  With rx_steer both are replaced by
+ *                netif_rx() and RPS on the virtual device.
  * =====================================================================================
  */
-
-struct sk_buff*
-vnic_skb_rebuild (struct sk_buff *skb)
+rx_handler_result_t
+vnic_skb_recv (struct sk_buff **pskb)
 {
+	struct sk_buff *skb = *pskb;
+	const struct vnic_tag_ops *ops;
+	struct vnic_group *grp;
+	struct net_device *vdev;
+	struct ethhdr *eth;
+	bool stripped;
+	int port;
 
-	const struct brcm_header *pb;
-	const unsigned char *stmp;
-	const unsigned char *dtmp;
+	grp = rcu_dereference(skb->dev->rx_handler_data);
+	ops = grp->tag_ops;
 
-	struct ethhdr *eth;
+	port = vnic_xdp_meta_port(skb);
+	stripped = port >= 0;
 
-	unsigned char src[6],dst[6];
-	unsigned char i;
-	unsigned short ptype;
+	if (likely(!stripped) && ops->rx_proto && skb->protocol != ops->rx_proto)
+		return RX_HANDLER_PASS;
 
-	pb = (struct brcm_header *)skb->data;
- 	stmp = pb->ether_shost;
-	dtmp = pb->ether_dhost;
-	ptype = pb->ether_type;
+	/* A tap on the real device holds a reference, clone the skb (not the data) */
+	skb = skb_share_check(skb, GFP_ATOMIC);
+	if (unlikely(!skb)) {
+		trace_vnic_rx_drop(grp->real_dev, 0, VNIC_RX_DROP_NOMEM);
+		return RX_HANDLER_CONSUMED;
+	}
+
+	if (likely(!stripped)) {
+		if (unlikely(!pskb_may_pull(skb, ops->rx_pull))) {
+			trace_vnic_rx_drop(grp->real_dev, 0, VNIC_RX_DROP_SHORT);
+			goto err_free;
+		}
 
-	for(i = 0; i < ETH_ALEN; i++,stmp++,dtmp++)
-	{
-		src[i] = *stmp;
-		dst[i] = *dtmp;
+		/* This packet is come form which port of real device */
+		port = vnic_tag_call(ops, parse_port, skb);
 	}
 
-	skb_pull(skb, BRCM_TAG_LEN);
+	vdev = likely(port >= 0) ? vnic_get_dev(grp, port) : NULL;
+	trace_vnic_port_lookup(grp->real_dev, port, vdev);
+        
+	if (NULL == vdev) {
+		trace_vnic_rx_drop(grp->real_dev, port, VNIC_RX_DROP_NO_PORT);
+		vnic_dbg("%s: can not find virtual device for port %d.\n", __FUNCTION__, port);
+		goto err_free;
+	}
 
-	eth = (struct ethhdr *)skb->data;
+	if (likely(!stripped)) {
+		skb = vnic_tag_call(ops, strip, skb, port);
+		if (unlikely(!skb)) {
+			trace_vnic_rx_drop(grp->real_dev, port, VNIC_RX_DROP_NOMEM);
+			this_cpu_inc(vnic_dev_info(vdev)->vnic_pcpu_stats->rx_dropped);
+			return RX_HANDLER_CONSUMED;
+		}
+	} else {
+		skb_metadata_clear(skb);
+	}
 
-	memcpy(eth->h_dest, dst, ETH_ALEN);
-	memcpy(eth->h_source, src, ETH_ALEN);
+	if (static_branch_unlikely(&vnic_rx_hash))
+		vnic_rx_set_hash(skb, port);
 
-	eth->h_proto = ptype;
+	trace_vnic_rx_demux(grp->real_dev, vdev, port, skb->len);
 
-	printk(KERN_INFO "%s: src = %02x:%02x:%02x:%02x:%02x:%02x \n",\
-			__FUNCTION__,eth->h_source[0],eth->h_source[1],eth->h_source[2],\
-			             eth->h_source[3],eth->h_source[4],eth->h_source[5]);
-	
+	skb->dev = vdev;
 
-	printk(KERN_INFO "%s: dst = %02x:%02x:%02x:%02x:%02x:%02x \n",\
-			__FUNCTION__,eth->h_dest[0],eth->h_dest[1],eth->h_dest[2],\
-			             eth->h_dest[3],eth->h_dest[4],eth->h_dest[5]);
+	/*
+	 * Generic XDP and AF_XDP sockets of the port look at the RX queue of
+	 * the real device, fold it onto the port's queues if it has fewer.
+	 */
+	if (unlikely(skb_rx_queue_recorded(skb) &&
+		     skb_get_rx_queue(skb) >= vdev->real_num_rx_queues))
+		skb_record_rx_queue(skb, skb_get_rx_queue(skb) % vdev->real_num_rx_queues);
+
+	/*
+	 * pkt_type was computed by the real device, against its own address
+	 * and for some formats on the tag instead of the destination.
+	 */
+	eth = eth_hdr(skb);
+	if (likely(!is_multicast_ether_addr(eth->h_dest)))
+		skb->pkt_type = ether_addr_equal_64bits(eth->h_dest, vdev->dev_addr) ?
+				PACKET_HOST : PACKET_OTHERHOST;
+	else
+		skb->pkt_type = is_broadcast_ether_addr(eth->h_dest) ?
+				PACKET_BROADCAST : PACKET_MULTICAST;
+
+	vnic_sample(vdev, skb, VNIC_SAMPLE_RX);
+
+	if (static_branch_unlikely(&vnic_fdb_enabled) && vnic_fdb_forward(grp, skb, vdev, port))
+		return RX_HANDLER_CONSUMED;
+
+	vnic_rx_stats_add(vdev, skb->len, skb->pkt_type == PACKET_MULTICAST);
+
+	if (static_branch_unlikely(&vnic_rx_steer)) {
+		netif_rx(skb);
+		return RX_HANDLER_CONSUMED;
+	}
 
-	printk(KERN_INFO "%s: proto = :%04x \n",__FUNCTION__,ntohs(eth->h_proto));
+	if (netif_elide_gro(vdev) ||
+	    ((stripped || ops->rx_gro) && !netif_elide_gro(grp->real_dev))) {
+		*pskb = skb;
+		return RX_HANDLER_ANOTHER;
+	}
 
-	return skb;
+	/* Coalesced by the per-CPU NAPI of the virtual device, a hop later */
+	gro_cells_receive(&vnic_dev_info(vdev)->gro_cells, skb);
+
+	return RX_HANDLER_CONSUMED;
+
+err_free:
+	kfree_skb(skb);
+	return RX_HANDLER_CONSUMED;
 }
 
-/* -----  end of function vnic_skb_rebuild  ----- */
+/* -----  end of function vnic_skb_recv  ----- */
 
-#endif
+/*
+ *  Flood merging.  A bridge floods a frame by sending clones of it, which
+ *  share the data, to each port in turn, within one BH section.  A
+ *  multicast clone reaching a bridge port is held per CPU and the clones
+ *  of the same data sent to other ports of the group are folded into its
+ *  port map; a BH work item, run once the flood is over, sends it with a
+ *  single port map tag.  Any other frame sent on the CPU first flushes the
+ *  held one, which keeps the order of the frames.
+ */
+struct vnic_flood {
+	struct sk_buff *skb;
+	struct net_device *dev;		/* first port, holds a reference */
+	u32 map;
+	struct work_struct work;
+};
+
+static DEFINE_PER_CPU(struct vnic_flood, vnic_flood);
+static DEFINE_STATIC_KEY_FALSE(vnic_flood_enabled);
+
+static bool flood_merge = true;
+module_param(flood_merge, bool, 0444);
+MODULE_PARM_DESC(flood_merge, "Send bridge floods to the ports of a group as one port map tagged copy");
+
+/* @tag in the traffic class the port maps @prio to */
+static inline u64
+vnic_dev_tc_tag (const struct vnic_device *vdev, u64 tag, unsigned int prio)
+{
+	if (!vdev->tag_ops->tc_tag)
+		return tag;
 
-int vnic_skb_recv(struct sk_buff *skb, struct net_device *dev, 
-		  struct packet_type *ptype, struct net_device *orig_dev)
+	return vdev->tag_ops->tc_tag(tag, READ_ONCE(vdev->prio_tc[prio & TC_BITMASK]));
+}
+
+static void
+vnic_flood_flush (struct vnic_flood *fl)
 {
+	struct net_device *dev = fl->dev;
+	struct vnic_device *vdev = vnic_dev_info(dev);
+	struct sk_buff *skb = fl->skb;
+	u64 tag;
+	int ret;
 
-#ifdef BROADCOM
+	fl->skb = NULL;
+	fl->dev = NULL;
 
-	struct net_device *vdev;
+	tag = vdev->tag_ops->build_map(fl->map);
+	tag = vnic_dev_tc_tag(vdev, tag, skb->priority);
 
-	unsigned char port;
+	if (unlikely(vnic_tag_call(vdev->tag_ops, insert, skb, tag))) {
+		this_cpu_inc(vdev->vnic_pcpu_stats->tx_dropped);
+		kfree_skb(skb);
+	} else {
+		trace_vnic_tx_tag(dev, vdev->real_dev, tag, skb->len);
 
-	skb = skb_share_check(skb, GFP_ATOMIC);
-	if (!skb) 
-		goto err_free;
+		skb->dev = vdev->real_dev;
+		ret = dev_queue_xmit(skb);
+		if (unlikely(ret != NET_XMIT_SUCCESS && ret != NET_XMIT_CN))
+			this_cpu_inc(vdev->vnic_pcpu_stats->tx_dropped);
+	}
 
-	/* This packet is come form which port of real device */
-	port = vnic_get_brcm_port(skb);
+	dev_put(dev);
+}
 
-	rcu_read_lock();
+static void
+vnic_flood_work (struct work_struct *work)
+{
+	struct vnic_flood *fl = container_of(work, struct vnic_flood, work);
 
-	vdev = vnic_get_dev(skb->dev->ifindex, port);
-        
-	if (NULL == vdev) {
-		printk(KERN_INFO "%s: can not find this virtual device.\n", __FUNCTION__);
-		goto err_unlock;
+	if (fl->skb)
+		vnic_flood_flush(fl);
+}
+
+static inline bool
+vnic_flood_same (const struct vnic_flood *fl, const struct sk_buff *skb,
+		 const struct vnic_device *vdev)
+{
+	const struct sk_buff *held = fl->skb;
+
+	return held->head == skb->head && held->data == skb->data &&
+	       held->len == skb->len && held->vlan_all == skb->vlan_all &&
+	       vnic_dev_info(fl->dev)->real_dev == vdev->real_dev;
+}
+
+/* 
+ * ===  FUNCTION  ======================================================================
+ *         Name:  vnic_flood_xmit
+ *  Description:  Returns true when the skb was held or folded into the held one, the
+ *                port counts it as sent.
+ * =====================================================================================
+ */
+static bool
+vnic_flood_xmit (struct sk_buff *skb, struct net_device *dev)
+{
+	struct vnic_flood *fl = this_cpu_ptr(&vnic_flood);
+	struct vnic_device *vdev = vnic_dev_info(dev);
+	unsigned int vid = READ_ONCE(vdev->vid);	/* vnic_port_move() */
+	bool mergeable;
+
+	mergeable = vid < vdev->tag_ops->map_ports && skb_cloned(skb) &&
+		    is_multicast_ether_addr(skb->data) && netif_is_bridge_port(dev);
+
+	if (fl->skb) {
+		if (mergeable && vnic_flood_same(fl, skb, vdev)) {
+			fl->map |= BIT(vid);
+			vnic_tx_stats_add(dev, skb->len);
+			consume_skb(skb);
+			return true;
+		}
+
+		vnic_flood_flush(fl);
 	}
 
-	skb->dev = vdev;
+	if (!mergeable)
+		return false;
 
-	if (dev != vnic_dev_info(skb->dev)->real_dev) {
-		printk(KERN_INFO "%s: drop the wrong packet.\n", __FUNCTION__);
-		skb->dev->stats.rx_errors++;
-		kfree_skb(skb);
+	dev_hold(dev);
+	fl->skb = skb;
+	fl->dev = dev;
+	fl->map = BIT(vid);
+	vnic_tx_stats_add(dev, skb->len);
+
+	queue_work(system_bh_wq, &fl->work);
+
+	return true;
+}
+
+/* -----  end of function vnic_flood_xmit  ----- */
+
+void
+vnic_flood_init (void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		INIT_WORK(&per_cpu(vnic_flood, cpu).work, vnic_flood_work);
+
+	if (flood_merge && vnic_tag_ops_get(VNIC_GRP_ID_BROADCOM)->build_map)
+		static_branch_enable(&vnic_flood_enabled);
+}
+
+void
+vnic_flood_fini (void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		flush_work(&per_cpu(vnic_flood, cpu).work);
+}
+
+/* One egress tag per priority, the TX path only indexes it */
+static void
+vnic_dev_update_prio_tags (struct net_device *dev)
+{
+	struct vnic_device *vdev = vnic_dev_info(dev);
+	unsigned int prio;
+	u64 tag;
+
+	for (prio = 0; prio <= TC_BITMASK; prio++) {
+		tag = vnic_dev_tc_tag(vdev, vdev->tx_tag, prio);
+		WRITE_ONCE(vdev->prio_tag[prio], tag);
 	}
+}
 
-	skb->dev->stats.rx_packets++;
-	skb->dev->stats.rx_bytes += skb->len;
+/* Egress tags of the switch port, again when the device moves to another one */
+void
+vnic_dev_build_tags (struct net_device *dev)
+{
+	struct vnic_device *vdev = vnic_dev_info(dev);
 
-	rcu_read_unlock();
+	WRITE_ONCE(vdev->tx_tag, vdev->tag_ops->build(vdev->vid));
+	vnic_dev_update_prio_tags(dev);
+}
 
-	printk(KERN_INFO "%s: packet send to %s.\n", __FUNCTION__, skb->dev->name);
+/* Priority of the DSCP, for frames the stack gave none */
+static unsigned int
+vnic_dscp_prio (const struct vnic_device *vdev, struct sk_buff *skb)
+{
+	u8 dsfield;
+
+	switch (skb->protocol) {
+		case htons(ETH_P_IP):
+			if (!pskb_network_may_pull(skb, sizeof(struct iphdr)))
+				return 0;
+			dsfield = ipv4_get_dsfield(ip_hdr(skb));
+			break;
+
+		case htons(ETH_P_IPV6):
+			if (!pskb_network_may_pull(skb, sizeof(struct ipv6hdr)))
+				return 0;
+			dsfield = ipv6_get_dsfield(ipv6_hdr(skb));
+			break;
+
+		default:
+			return 0;
+	}
+
+	return READ_ONCE(vdev->dscp_prio[dsfield >> 2]);
+}
 
-	skb = vnic_skb_rebuild(skb);
+/* 
+ * ===  FUNCTION  ======================================================================
+ *         Name:  vnic_dev_set_dscp_map
+ *  Description:  DSCP -> priority map of the port, an all zero map turns it off.
+ *                rtnl must be held.
+ * =====================================================================================
+ */
+void
+vnic_dev_set_dscp_map (struct net_device *dev, const u8 *map)
+{
+	struct vnic_device *vdev = vnic_dev_info(dev);
+	bool used = false;
+	unsigned int i;
 
-	if (!skb) {
-		printk(KERN_INFO "%s: fail to remove brcm tag.\n", __FUNCTION__);
-	        goto err_free;
+	for (i = 0; i < ARRAY_SIZE(vdev->dscp_prio); i++) {
+		WRITE_ONCE(vdev->dscp_prio[i], map[i] & TC_BITMASK);
+		used |= map[i];
 	}
 
-	netif_rx(skb);
+	WRITE_ONCE(vdev->dscp_map, used);
+}
 
-#endif
-	return NET_RX_SUCCESS;
+/* -----  end of function vnic_dev_set_dscp_map  ----- */
 
-err_unlock:
-	rcu_read_unlock();
-err_free:
-	kfree_skb(skb);
-	return NET_RX_DROP;
+/* 
+ * ===  FUNCTION  ======================================================================
+ *         Name:  vnic_dev_set_prio_tc
+ *  Description:  Priority -> traffic class map of the port, the same as mqprio sets
+ *                but for a port without the queues mqprio needs.  rtnl must be held.
+ * =====================================================================================
+ */
+void
+vnic_dev_set_prio_tc (struct net_device *dev, const u8 *map)
+{
+	struct vnic_device *vdev = vnic_dev_info(dev);
+
+	memcpy(vdev->prio_tc, map, sizeof(vdev->prio_tc));
+	vnic_dev_update_prio_tags(dev);
 }
 
+/* -----  end of function vnic_dev_set_prio_tc  ----- */
 
+/* 
+ * ===  FUNCTION  ======================================================================
+ *         Name:  vnic_dev_setup_tc
+ *  Description:  mqprio offload: the traffic classes of the port are the egress queues
+ *                of the switch port, selected by the tag.  The TX queues stay those of
+ *                the real device, whose own mqprio maps the same skb->priority.
+ *
+ *                tc qdisc add dev brcm0 root mqprio num_tc 4 map 0 0 1 1 2 2 3 3 \
+ *                        queues 1@0 1@0 1@0 1@0 hw 1
+ *
+ *                mqprio wants a multiqueue device, IFLA_VNIC_PRIO_TC sets the map
+ *                without it.
+ * =====================================================================================
+ */
+static int
+vnic_dev_setup_tc (struct net_device *dev, enum tc_setup_type type, void *type_data)
+{
+	struct tc_mqprio_qopt_offload *mqprio = type_data;
+	struct vnic_device *vdev = vnic_dev_info(dev);
+	unsigned int i;
+	u8 num_tc;
+
+	/* Caps queries and block offloads pass other structures */
+	if (type != TC_SETUP_QDISC_MQPRIO)
+		return -EOPNOTSUPP;
+
+	num_tc = mqprio->qopt.num_tc;
+
+	if (num_tc > VNIC_TAG_TCS)
+		return -EINVAL;
+
+	if (!num_tc) {
+		netdev_reset_tc(dev);
+		memset(vdev->prio_tc, 0, sizeof(vdev->prio_tc));
+	} else {
+		netdev_set_num_tc(dev, num_tc);
+		for (i = 0; i < num_tc; i++)
+			netdev_set_tc_queue(dev, i, mqprio->qopt.count[i], mqprio->qopt.offset[i]);
+		for (i = 0; i <= TC_BITMASK; i++) {
+			netdev_set_prio_tc_map(dev, i, mqprio->qopt.prio_tc_map[i]);
+			vdev->prio_tc[i] = mqprio->qopt.prio_tc_map[i];
+		}
+	}
+
+	vnic_dev_update_prio_tags(dev);
+
+	mqprio->qopt.hw = TC_MQPRIO_HW_OFFLOAD_TCS;
+
+	return 0;
+}
+
+/* -----  end of function vnic_dev_setup_tc  ----- */
 
 /* 
  * ===  FUNCTION  ======================================================================
@@ -175,22 +537,113 @@ err_free:
  *  Description:  
  * =====================================================================================
  */
-int
+static netdev_tx_t
 vnic_dev_hard_start_xmit (struct sk_buff *skb, struct net_device *dev)
 {
-	printk(KERN_INFO "%s: %s send packet.\n", __FUNCTION__, dev->name);
+	struct vnic_device *vdev = vnic_dev_info(dev);
+	unsigned int len = skb->len;
+	unsigned int prio;
+	u64 tag;
+	int ret;
 
-	skb->dev->stats.tx_packets++;
-	skb->dev->stats.tx_bytes += skb->len;
+	vnic_sample(dev, skb, VNIC_SAMPLE_TX);
 
-	skb->dev = vnic_dev_info(dev)->real_dev;
+	/* The real device's mqprio sees the priority taken from the DSCP too, floods as well */
+	if (unlikely(READ_ONCE(vdev->dscp_map)) && !skb->priority)
+		skb->priority = vnic_dscp_prio(vdev, skb);
 
-	dev_queue_xmit(skb);
+	if (static_branch_unlikely(&vnic_flood_enabled) && vnic_flood_xmit(skb, dev))
+		return NETDEV_TX_OK;
 
-	return 0;
+	prio = skb->priority & TC_BITMASK;
+	tag = READ_ONCE(vdev->prio_tag[prio]);
+
+	if (unlikely(vnic_tag_call(vdev->tag_ops, insert, skb, tag))) {
+		this_cpu_inc(vdev->vnic_pcpu_stats->tx_dropped);
+		kfree_skb(skb);
+		return NETDEV_TX_OK;
+	}
+
+	trace_vnic_tx_tag(dev, vdev->real_dev, tag, skb->len);
+
+	skb->dev = vdev->real_dev;
+
+	ret = dev_queue_xmit(skb);
+
+	if (likely(ret == NET_XMIT_SUCCESS || ret == NET_XMIT_CN))
+		vnic_tx_stats_add(dev, len);
+	else
+		this_cpu_inc(vdev->vnic_pcpu_stats->tx_dropped);
+
+	return NETDEV_TX_OK;
 }		
 /* -----  end of function vnic_dev_xmit  ----- */
 
+/* 
+ * ===  FUNCTION  ======================================================================
+ *         Name:  vnic_dev_xdp_xmit
+ *  Description:  XDP transmit: native redirects to a virtual port, e.g. from the port
+ *                programs of the XDP dispatcher to another port.  The egress tag is
+ *                written in the frame's headroom and the batch goes to the real
+ *                device's ndo_xdp_xmit.  Frames without room
+ *                for the tag are moved behind the others, the caller frees whatever
+ *                is not counted in the return value.
+ * =====================================================================================
+ */
+static int
+vnic_dev_xdp_xmit (struct net_device *dev, int n, struct xdp_frame **frames, u32 flags)
+{
+	struct vnic_device *vdev = vnic_dev_info(dev);
+	struct net_device *real_dev = vdev->real_dev;
+	unsigned int tag_len = vdev->tag_ops->tag_len;
+	unsigned int push_len = 0;
+	struct xdp_frame *xdpf;
+	int i, ready = 0, nxmit;
+	u64 bytes = 0, tag;
+	void *data;
+
+	if (unlikely(!real_dev->netdev_ops->ndo_xdp_xmit))
+		return -EOPNOTSUPP;
+
+	/* XDP frames carry no priority, they go in the class of priority 0 */
+	tag = READ_ONCE(vdev->prio_tag[0]);
+
+	for (i = 0; i < n; i++) {
+		xdpf = frames[i];
+		if (unlikely(xdpf->headroom < tag_len))
+			continue;
+
+		/* A port of a cascaded switch pushes two tags, the others one */
+		data            = vnic_tag_call(vdev->tag_ops, push, xdpf->data, tag);
+		push_len        = xdpf->data - data;
+		bytes          += xdpf->len;
+		xdpf->data      = data;
+		xdpf->len      += push_len;
+		xdpf->headroom -= push_len;
+		xdpf->metasize  = 0;
+
+		frames[i] = frames[ready];
+		frames[ready++] = xdpf;
+	}
+
+	nxmit = ready ? real_dev->netdev_ops->ndo_xdp_xmit(real_dev, ready, frames, flags) : 0;
+	if (unlikely(nxmit < 0))
+		return nxmit;
+
+	/* Only the frames not taken by the real device may still be looked at */
+	for (i = nxmit; i < ready; i++)
+		bytes -= frames[i]->len - push_len;
+
+	if (nxmit)
+		vnic_tx_stats_bulk_add(dev, nxmit, bytes);
+	if (unlikely(nxmit < n))
+		this_cpu_add(vdev->vnic_pcpu_stats->tx_dropped, n - nxmit);
+
+	return nxmit;
+}
+
+/* -----  end of function vnic_dev_xdp_xmit  ----- */
+
 
 /* 
  * ===  FUNCTION  ======================================================================
@@ -198,7 +651,7 @@ vnic_dev_hard_start_xmit (struct sk_buff *skb, struct net_device *dev)
  *  Description:  
  * =====================================================================================
  */
-int
+static int
 vnic_dev_set_mac_address (struct net_device *dev, void *address)
 {
 
@@ -207,14 +660,35 @@ vnic_dev_set_mac_address (struct net_device *dev, void *address)
 	if (netif_running(dev))
 		return -EBUSY;
 
-	memcpy(dev->dev_addr, addr->sa_data, dev->addr_len);
+	if (!is_valid_ether_addr(addr->sa_data))
+		return -EADDRNOTAVAIL;
+
+	eth_hw_addr_set(dev, addr->sa_data);
 
-	printk(KERN_INFO "%s: Set Mac address for %s .\n", __FUNCTION__, dev->name);
+	vnic_dbg("%s: Set Mac address for %s .\n", __FUNCTION__, dev->name);
 
 	return 0;
 }		
 /* -----  end of function vnic_dev_set_mac_address  ----- */
 
+/* 
+ * ===  FUNCTION  ======================================================================
+ *         Name:  vnic_dev_sync_queues
+ *  Description:  Follow the queue count of the real device, as far as the port was
+ *                allocated with.  Again on open, "ethtool -L" does not notify us.
+ * =====================================================================================
+ */
+static void
+vnic_dev_sync_queues (struct net_device *dev)
+{
+	struct net_device *real_dev = vnic_dev_info(dev)->real_dev;
+
+	netif_set_real_num_tx_queues(dev, min(dev->num_tx_queues, real_dev->real_num_tx_queues));
+	netif_set_real_num_rx_queues(dev, min(dev->num_rx_queues, real_dev->real_num_rx_queues));
+}
+
+/* -----  end of function vnic_dev_sync_queues  ----- */
+
 /* 
  * ===  FUNCTION  ======================================================================
  *         Name:  vnic_dev_init
@@ -226,9 +700,33 @@ vnic_dev_init (struct net_device *dev)
 {
 	struct net_device* real_dev = vnic_dev_info(dev)->real_dev;
 
-	printk(KERN_INFO "%s: dev = %s, real_dev = %s .\n", __FUNCTION__, dev->name, real_dev->name);
+	vnic_dbg("%s: dev = %s, real_dev = %s .\n", __FUNCTION__, dev->name, real_dev->name);
 
-	memcpy(dev->dev_addr, real_dev->dev_addr, dev->addr_len);
+	/* Unless rtnetlink was given one */
+	if (is_zero_ether_addr(dev->dev_addr))
+		eth_hw_addr_set(dev, real_dev->dev_addr);
+
+	dev->hw_features = VNIC_FEATURES;
+	dev->features   |= VNIC_FEATURES;
+	netif_inherit_tso_max(dev, real_dev);
+	dev->xdp_features = real_dev->xdp_features & VNIC_XDP_FEATURES;
+
+	vnic_dev_sync_queues(dev);
+
+	/* Let the stack leave room for the egress tag */
+	dev->needed_headroom = real_dev->needed_headroom + vnic_dev_info(dev)->tag_ops->tag_len;
+
+	vnic_dev_build_tags(dev);
+
+	vnic_dev_info(dev)->vnic_pcpu_stats = netdev_alloc_pcpu_stats(struct vnic_pcpu_stats);
+	if (!vnic_dev_info(dev)->vnic_pcpu_stats)
+		return -ENOMEM;
+
+	if (gro_cells_init(&vnic_dev_info(dev)->gro_cells, dev)) {
+		free_percpu(vnic_dev_info(dev)->vnic_pcpu_stats);
+		vnic_dev_info(dev)->vnic_pcpu_stats = NULL;
+		return -ENOMEM;
+	}
 
 	return 0;
 }
@@ -245,6 +743,8 @@ vnic_dev_init (struct net_device *dev)
 static void
 vnic_dev_uninit (struct net_device *dev)
 {
+	vnic_sample_set(dev, 0);
+	gro_cells_destroy(&vnic_dev_info(dev)->gro_cells);
 }	
 
 /* -----  end of function vnic_dev_uninit  ----- */
@@ -261,10 +761,125 @@ vnic_dev_open (struct net_device *dev)
 	if (!(vnic_dev_info(dev)->real_dev->flags & IFF_UP))
 		return -ENETDOWN;
 
+	vnic_dev_sync_queues(dev);
+
 	return 0;
 }	
 /* -----  end of function vnic_dev_open  ----- */
 
+/* 
+ * ===  FUNCTION  ======================================================================
+ *         Name:  vnic_dev_fix_features
+ *  Description:  Clamp the offloads to what the real device can do behind the tag
+ * =====================================================================================
+ */
+static netdev_features_t
+vnic_dev_fix_features (struct net_device *dev, netdev_features_t features)
+{
+	struct net_device *real_dev = vnic_dev_info(dev)->real_dev;
+	netdev_features_t old_features = features;
+	netdev_features_t lower_features;
+
+	lower_features = netdev_intersect_features(real_dev->vlan_features | NETIF_F_RXCSUM,
+						   real_dev->features);
+
+	/*
+	 * csum_start/csum_offset are not moved by the tag.  Keep HW_CSUM so
+	 * the real device's validate_xmit falls back per protocol.
+	 */
+	if (lower_features & (NETIF_F_IP_CSUM | NETIF_F_IPV6_CSUM))
+		lower_features |= NETIF_F_HW_CSUM;
+
+	features = netdev_intersect_features(features, lower_features);
+	features |= old_features & (NETIF_F_SOFT_FEATURES | NETIF_F_GSO_SOFTWARE);
+
+	return features;
+}
+
+/* -----  end of function vnic_dev_fix_features  ----- */
+
+/* 
+ * ===  FUNCTION  ======================================================================
+ *         Name:  vnic_dev_select_queue
+ *  Description:  Pick the queue the real device would pick.  The choice is cached in
+ *                the socket, so dev_queue_xmit() on the real device lands the flow on
+ *                the same real TX queue again.  Folded into our own queues, the real
+ *                device may have more of them than the port.
+ * =====================================================================================
+ */
+static u16
+vnic_dev_select_queue (struct net_device *dev, struct sk_buff *skb, struct net_device *sb_dev)
+{
+	u16 txq = netdev_pick_tx(vnic_dev_info(dev)->real_dev, skb, NULL);
+
+	if (unlikely(txq >= dev->real_num_tx_queues))
+		txq %= dev->real_num_tx_queues;
+
+	return txq;
+}
+
+/* -----  end of function vnic_dev_select_queue  ----- */
+
+/* 
+ * ===  FUNCTION  ======================================================================
+ *         Name:  vnic_dev_get_stats64
+ *  Description:  Fold the per-CPU counters of the virtual device
+ * =====================================================================================
+ */
+static void
+vnic_dev_get_stats64 (struct net_device *dev, struct rtnl_link_stats64 *stats)
+{
+	u64 rx_packets, rx_bytes, rx_multicast, tx_packets, tx_bytes;
+	const struct vnic_pcpu_stats *p;
+	unsigned int start;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		p = per_cpu_ptr(vnic_dev_info(dev)->vnic_pcpu_stats, cpu);
+
+		do {
+			start        = u64_stats_fetch_begin(&p->syncp);
+			rx_packets   = u64_stats_read(&p->rx_packets);
+			rx_bytes     = u64_stats_read(&p->rx_bytes);
+			rx_multicast = u64_stats_read(&p->rx_multicast);
+			tx_packets   = u64_stats_read(&p->tx_packets);
+			tx_bytes     = u64_stats_read(&p->tx_bytes);
+		} while (u64_stats_fetch_retry(&p->syncp, start));
+
+		stats->rx_packets += rx_packets;
+		stats->rx_bytes   += rx_bytes;
+		stats->multicast  += rx_multicast;
+		stats->tx_packets += tx_packets;
+		stats->tx_bytes   += tx_bytes;
+
+		/* u32 counters, not covered by syncp */
+		stats->rx_dropped += READ_ONCE(p->rx_dropped);
+		stats->tx_dropped += READ_ONCE(p->tx_dropped);
+	}
+}
+
+/* -----  end of function vnic_dev_get_stats64  ----- */
+
+static void
+vnic_dev_free (struct net_device *dev)
+{
+	free_percpu(vnic_dev_info(dev)->vnic_pcpu_stats);
+	vnic_dev_info(dev)->vnic_pcpu_stats = NULL;
+}
+
+static const struct net_device_ops vnic_netdev_ops = {
+	.ndo_init            = vnic_dev_init,
+	.ndo_uninit          = vnic_dev_uninit,
+	.ndo_open            = vnic_dev_open,
+	.ndo_start_xmit      = vnic_dev_hard_start_xmit,
+	.ndo_select_queue    = vnic_dev_select_queue,
+	.ndo_set_mac_address = vnic_dev_set_mac_address,
+	.ndo_get_stats64     = vnic_dev_get_stats64,
+	.ndo_fix_features    = vnic_dev_fix_features,
+	.ndo_xdp_xmit        = vnic_dev_xdp_xmit,
+	.ndo_setup_tc        = vnic_dev_setup_tc,
+};
+
 /* 
  * ===  FUNCTION  ======================================================================
  *         Name:  vnic_netdev_setup
@@ -274,18 +889,18 @@ vnic_dev_open (struct net_device *dev)
 void
 vnic_netdev_setup (struct net_device *dev)
 {
-	SET_MODULE_OWNER(dev);
 	ether_setup(dev);
 
-	dev->priv_flags      |= IFF_VNIC;
-	dev->tx_queue_len     = 0;
+	dev->priv_flags        |= IFF_VNIC | IFF_NO_QUEUE;
+	dev->tx_queue_len       = 0;
+
+	/* No qdisc and no TX lock of our own, the real device queues the frame */
+	dev->lltx               = true;
 
-	dev->open             = vnic_dev_open;
-	dev->init             = vnic_dev_init;
-	dev->uninit           = vnic_dev_uninit;
-	dev->hard_start_xmit  = vnic_dev_hard_start_xmit;
-	dev->set_mac_address  = vnic_dev_set_mac_address;
-	dev->destructor       = free_netdev;
+	dev->netdev_ops         = &vnic_netdev_ops;
+	dev->rtnl_link_ops      = &vnic_link_ops;
+	dev->needs_free_netdev  = true;
+	dev->priv_destructor    = vnic_dev_free;
 
 }	
 
@@ -4,6 +4,16 @@
 
 #include <linux/netdevice.h>
 
+/* What a virtual port can offer when its real device offers it */
+#define VNIC_XDP_FEATURES (NETDEV_XDP_ACT_NDO_XMIT | NETDEV_XDP_ACT_NDO_XMIT_SG)
+
 void vnic_netdev_setup(struct net_device *dev);
-int vnic_skb_recv(struct sk_buff *skb, struct net_device *dev, struct packet_type *ptype, struct net_device *orig_dev);
+rx_handler_result_t vnic_skb_recv(struct sk_buff **pskb);
+void vnic_dev_set_dscp_map(struct net_device *dev, const u8 *map);
+void vnic_dev_set_prio_tc(struct net_device *dev, const u8 *map);
+void vnic_dev_build_tags(struct net_device *dev);
+
+void vnic_rx_init(void);
+void vnic_flood_init(void);
+void vnic_flood_fini(void);
 #endif
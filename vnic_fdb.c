@@ -0,0 +1,290 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  vnic_fdb.c
+ *
+ *    Description:  In-driver L2 forwarding between the ports of a group, RCU hash
+ *                  FDB learned on receive and aged out by a delayed work
+ *
+ * =====================================================================================
+ */
+
+#include <linux/netdevice.h>
+#include <linux/etherdevice.h>
+#include <linux/if_bridge.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+
+#include "vnic_core.h"
+#include "vnic_fdb.h"
+#include "vnic_trace.h"
+
+#define VNIC_FDB_HASH_BITS     8
+#define VNIC_FDB_MAX           4096
+#define VNIC_FDB_GC_INTERVAL   HZ
+
+DEFINE_STATIC_KEY_FALSE(vnic_fdb_enabled);
+
+static bool fdb_fastpath;
+module_param(fdb_fastpath, bool, 0444);
+MODULE_PARM_DESC(fdb_fastpath, "Forward between bridged ports of a group without the stack");
+
+static unsigned int fdb_ageing = 300;
+module_param(fdb_ageing, uint, 0644);
+MODULE_PARM_DESC(fdb_ageing, "Seconds an unused FDB entry is kept");
+
+struct vnic_fdb_entry {
+	struct hlist_node hlist;
+	unsigned char addr[ETH_ALEN];
+	unsigned int port;
+	unsigned long updated;
+	struct rcu_head rcu;
+};
+
+struct vnic_fdb {
+	DECLARE_HASHTABLE(hash, VNIC_FDB_HASH_BITS);
+	spinlock_t lock;		/* writers, readers are under RCU */
+	unsigned int count;
+	struct delayed_work gc;
+	struct rcu_head rcu;
+};
+
+static u32 vnic_fdb_salt __read_mostly;
+
+static inline u32
+vnic_fdb_hash (const unsigned char *addr)
+{
+	return jhash(addr, ETH_ALEN, vnic_fdb_salt);
+}
+
+static struct vnic_fdb_entry *
+vnic_fdb_find (struct vnic_fdb *fdb, const unsigned char *addr, u32 key)
+{
+	struct vnic_fdb_entry *e;
+
+	hash_for_each_possible_rcu(fdb->hash, e, hlist, key) {
+		if (ether_addr_equal(e->addr, addr))
+			return e;
+	}
+
+	return NULL;
+}
+
+/* Only touches a known entry when it changes, a steady flow keeps it clean */
+static void
+vnic_fdb_learn (struct vnic_fdb *fdb, const unsigned char *addr, unsigned int port)
+{
+	struct vnic_fdb_entry *e;
+	u32 key;
+
+	if (unlikely(!is_valid_ether_addr(addr)))
+		return;
+
+	key = vnic_fdb_hash(addr);
+
+	e = vnic_fdb_find(fdb, addr, key);
+	if (likely(e)) {
+		if (unlikely(READ_ONCE(e->port) != port))
+			WRITE_ONCE(e->port, port);
+		if (READ_ONCE(e->updated) != jiffies)
+			WRITE_ONCE(e->updated, jiffies);
+		return;
+	}
+
+	spin_lock(&fdb->lock);
+
+	if (!vnic_fdb_find(fdb, addr, key) && fdb->count < VNIC_FDB_MAX) {
+		e = kmalloc(sizeof(*e), GFP_ATOMIC);
+		if (e) {
+			ether_addr_copy(e->addr, addr);
+			e->port = port;
+			e->updated = jiffies;
+			hash_add_rcu(fdb->hash, &e->hlist, key);
+			fdb->count++;
+		}
+	}
+
+	spin_unlock(&fdb->lock);
+}
+
+/*
+ * Both ports forwarding in the same bridge, which does no VLAN filtering.
+ * A modular bridge is out of reach of a built-in vnic, no fastpath then.
+ */
+static bool
+vnic_fdb_bridged (const struct net_device *in, const struct net_device *out)
+{
+#if IS_REACHABLE(CONFIG_BRIDGE)
+	struct net_device *br = netdev_master_upper_dev_get_rcu((struct net_device *)in);
+
+	return br && netif_is_bridge_master(br) &&
+	       netdev_master_upper_dev_get_rcu((struct net_device *)out) == br &&
+	       !br_vlan_enabled(br) &&
+	       br_port_get_stp_state(in) == BR_STATE_FORWARDING &&
+	       br_port_get_stp_state(out) == BR_STATE_FORWARDING &&
+	       netif_running(out) && netif_carrier_ok(out);
+#else
+	return false;
+#endif
+}
+
+/* 
+ * ===  FUNCTION  ======================================================================
+ *         Name:  vnic_fdb_forward
+ *  Description:  Called by the rx_handler with the tag stripped and pkt_type set for
+ *                the ingress port @dev.  Returns true when the skb was forwarded or
+ *                dropped here.  Netfilter and the bridge's own FDB are bypassed, the
+ *                bridge still learns from what takes the stack.
+ * =====================================================================================
+ */
+bool
+vnic_fdb_forward (struct vnic_group *grp, struct sk_buff *skb, struct net_device *dev, unsigned int port)
+{
+	const struct ethhdr *eth = eth_hdr(skb);
+	struct vnic_fdb *fdb = grp->fdb;
+	struct vnic_fdb_entry *e;
+	struct net_device *out;
+	unsigned int out_port, len;
+	u64 tag;
+	int ret;
+
+	vnic_fdb_learn(fdb, eth->h_source, port);
+
+	if (skb->pkt_type != PACKET_OTHERHOST)
+		return false;
+
+	e = vnic_fdb_find(fdb, eth->h_dest, vnic_fdb_hash(eth->h_dest));
+	if (!e)
+		return false;
+
+	out_port = READ_ONCE(e->port);
+	if (out_port == port)
+		return false;
+
+	out = vnic_get_dev(grp, out_port);
+	if (!out || !vnic_fdb_bridged(dev, out))
+		return false;
+
+	len = skb->len;
+
+	skb_push(skb, ETH_HLEN);
+	if (unlikely(!is_skb_forwardable(out, skb)))
+		goto drop;
+
+	skb_forward_csum(skb);
+
+	vnic_rx_stats_add(dev, len, false);
+
+	/* The port may move meanwhile, one tag for insert and trace */
+	tag = READ_ONCE(vnic_dev_info(out)->prio_tag[skb->priority & TC_BITMASK]);
+
+	if (unlikely(vnic_tag_call(grp->tag_ops, insert, skb, tag))) {
+		this_cpu_inc(vnic_dev_info(out)->vnic_pcpu_stats->tx_dropped);
+		kfree_skb(skb);
+		return true;
+	}
+
+	trace_vnic_tx_tag(out, grp->real_dev, tag, skb->len);
+
+	skb->dev = grp->real_dev;
+
+	ret = dev_queue_xmit(skb);
+	if (likely(ret == NET_XMIT_SUCCESS || ret == NET_XMIT_CN))
+		vnic_tx_stats_add(out, len);
+	else
+		this_cpu_inc(vnic_dev_info(out)->vnic_pcpu_stats->tx_dropped);
+
+	return true;
+
+drop:
+	this_cpu_inc(vnic_dev_info(dev)->vnic_pcpu_stats->rx_dropped);
+	kfree_skb(skb);
+	return true;
+}
+
+/* -----  end of function vnic_fdb_forward  ----- */
+
+/* Drops the entries of @port, or all of them for a negative @port */
+static void
+vnic_fdb_flush (struct vnic_fdb *fdb, int port, unsigned long timeout)
+{
+	struct vnic_fdb_entry *e;
+	struct hlist_node *tmp;
+	unsigned int bkt;
+
+	spin_lock_bh(&fdb->lock);
+
+	hash_for_each_safe(fdb->hash, bkt, tmp, e, hlist) {
+		if (port >= 0 && READ_ONCE(e->port) != (unsigned int)port)
+			continue;
+		if (timeout && time_before(jiffies, READ_ONCE(e->updated) + timeout))
+			continue;
+
+		hash_del_rcu(&e->hlist);
+		kfree_rcu(e, rcu);
+		fdb->count--;
+	}
+
+	spin_unlock_bh(&fdb->lock);
+}
+
+static void
+vnic_fdb_gc (struct work_struct *work)
+{
+	struct vnic_fdb *fdb = container_of(to_delayed_work(work), struct vnic_fdb, gc);
+
+	vnic_fdb_flush(fdb, -1, max_t(unsigned long, READ_ONCE(fdb_ageing) * HZ, 1));
+
+	queue_delayed_work(system_power_efficient_wq, &fdb->gc, VNIC_FDB_GC_INTERVAL);
+}
+
+int
+vnic_fdb_create (struct vnic_group *grp)
+{
+	struct vnic_fdb *fdb;
+
+	fdb = kzalloc(sizeof(*fdb), GFP_KERNEL);
+	if (!fdb)
+		return -ENOMEM;
+
+	hash_init(fdb->hash);
+	spin_lock_init(&fdb->lock);
+	INIT_DELAYED_WORK(&fdb->gc, vnic_fdb_gc);
+	queue_delayed_work(system_power_efficient_wq, &fdb->gc, VNIC_FDB_GC_INTERVAL);
+
+	grp->fdb = fdb;
+
+	return 0;
+}
+
+/* After the rx_handler is gone, readers may still be running */
+void
+vnic_fdb_destroy (struct vnic_group *grp)
+{
+	struct vnic_fdb *fdb = grp->fdb;
+
+	if (!fdb)
+		return;
+
+	cancel_delayed_work_sync(&fdb->gc);
+	vnic_fdb_flush(fdb, -1, 0);
+
+	kfree_rcu(fdb, rcu);
+}
+
+void
+vnic_fdb_flush_port (struct vnic_group *grp, unsigned int port)
+{
+	if (grp->fdb)
+		vnic_fdb_flush(grp->fdb, port, 0);
+}
+
+void __init
+vnic_fdb_init (void)
+{
+	vnic_fdb_salt = get_random_u32();
+
+	if (fdb_fastpath)
+		static_branch_enable(&vnic_fdb_enabled);
+}
@@ -0,0 +1,24 @@
+#ifndef __VNIC_FDB_INC__
+#define __VNIC_FDB_INC__
+
+#include <linux/netdevice.h>
+#include <linux/jump_label.h>
+
+#include "vnic_core.h"
+
+/*
+ *  Optional forwarding table of a group ("fdb_fastpath" module parameter).
+ *  Source addresses are learned on the ports in the rx_handler, a unicast
+ *  frame for an address learned on another port of the same bridge is
+ *  tagged again and sent back out of the real device without entering the
+ *  stack.
+ */
+DECLARE_STATIC_KEY_FALSE(vnic_fdb_enabled);
+
+int vnic_fdb_create(struct vnic_group *grp);
+void vnic_fdb_destroy(struct vnic_group *grp);
+void vnic_fdb_flush_port(struct vnic_group *grp, unsigned int port);
+bool vnic_fdb_forward(struct vnic_group *grp, struct sk_buff *skb, struct net_device *dev, unsigned int port);
+void vnic_fdb_init(void);
+
+#endif
@@ -0,0 +1,818 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  vnic_kunit.c
+ *
+ *    Description:  KUnit tests and microbenchmarks of the receive fast path: tag
+ *                  parse, strip, insert, port lookup and the rx_handler itself, on
+ *                  synthetic frames and unregistered devices (runs under UML)
+ *
+ * =====================================================================================
+ */
+
+#include <kunit/test.h>
+#include <linux/etherdevice.h>
+#include <linux/ktime.h>
+#include <linux/rtnetlink.h>
+#include <net/checksum.h>
+
+#include "vnic_core.h"
+#include "vnic_dev.h"
+#include "vnic_netlink.h"
+#include "vnic_sample.h"
+
+#define VNIC_KUNIT_PORT      3
+#define VNIC_KUNIT_CASCADE   5
+#define VNIC_KUNIT_PAYLOAD   46
+#define VNIC_BENCH_BATCH     256
+#define VNIC_BENCH_ROUNDS    64
+
+static const u8 vnic_kunit_da[ETH_ALEN] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+static const u8 vnic_kunit_sa[ETH_ALEN] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x02 };
+
+struct vnic_kunit_ctx {
+	struct net_device *real_dev;
+	struct net_device *vdev;
+	struct vnic_group *grp;
+};
+
+static const struct vnic_tag_ops *vnic_kunit_ops(void)
+{
+	return vnic_tag_ops_get(VNIC_GRP_ID_BROADCOM);
+}
+
+/*
+ * A frame as the real device hands it to its rx_handler: @depth ingress tags
+ * of the active Broadcom profile, outermost first, eth_type_trans() already
+ * run.  @len is cut to build short frames, 0 keeps the whole frame.
+ */
+static struct sk_buff *vnic_kunit_stack(struct vnic_kunit_ctx *ctx, const int *ports,
+					unsigned int depth, unsigned int len)
+{
+	const struct vnic_tag_ops *ops = vnic_kunit_ops();
+	bool prepend = ops->tag_len == BRCM_PREPEND_LEN;
+	struct sk_buff *skb;
+	u8 *p, *tags, *tag;
+	unsigned int i;
+
+	skb = alloc_skb(NET_SKB_PAD + 2 * BRCM_PREPEND_LEN + ETH_HLEN + VNIC_KUNIT_PAYLOAD, GFP_KERNEL);
+	if (!skb)
+		return NULL;
+
+	skb_reserve(skb, NET_SKB_PAD);
+	p = skb_put_zero(skb, depth * ops->tag_len + ETH_HLEN + VNIC_KUNIT_PAYLOAD);
+
+	tags = p + BRCM_PREPEND_LEN - BRCM_TAG_LEN;
+	if (prepend)
+		p += depth * BRCM_PREPEND_LEN;
+
+	memcpy(p, vnic_kunit_da, ETH_ALEN);
+	memcpy(p + ETH_ALEN, vnic_kunit_sa, ETH_ALEN);
+	p += 2 * ETH_ALEN;
+
+	if (!prepend) {
+		tags = p;
+		p += depth * BRCM_TAG_LEN;
+	}
+
+	for (i = 0; i < depth; i++) {
+		tag = tags + i * ops->tag_len;
+		if (ops->rx_proto)
+			put_unaligned(ops->rx_proto, (__be16 *)tag);
+		tag[3] = ports[i];
+	}
+
+	put_unaligned(htons(ETH_P_IP), (__be16 *)p);
+	p += 2;
+
+	for (i = 0; i < VNIC_KUNIT_PAYLOAD; i++)
+		p[i] = i;
+
+	if (len)
+		skb_trim(skb, len);
+
+	skb->protocol = eth_type_trans(skb, ctx->real_dev);
+
+	return skb;
+}
+
+static struct sk_buff *vnic_kunit_frame(struct vnic_kunit_ctx *ctx, int port, bool tagged,
+					unsigned int len)
+{
+	return vnic_kunit_stack(ctx, &port, tagged, len);
+}
+
+static int vnic_kunit_init(struct kunit *test)
+{
+	const struct vnic_tag_ops *ops = vnic_kunit_ops();
+	struct vnic_kunit_ctx *ctx;
+	struct vnic_device *vdev;
+	struct vnic_ports *ports;
+
+	ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, ctx);
+
+	ctx->real_dev = alloc_etherdev(0);
+	KUNIT_ASSERT_NOT_NULL(test, ctx->real_dev);
+	eth_hw_addr_random(ctx->real_dev);
+
+	/* GRO off: the rx_handler retargets the frame instead of queueing it */
+	ctx->vdev = alloc_netdev(sizeof(struct vnic_device), "vnictest%d", NET_NAME_ENUM, ether_setup);
+	KUNIT_ASSERT_NOT_NULL(test, ctx->vdev);
+	eth_hw_addr_set(ctx->vdev, vnic_kunit_da);
+
+	vdev = vnic_dev_info(ctx->vdev);
+	vdev->real_dev = ctx->real_dev;
+	vdev->vid = VNIC_KUNIT_PORT;
+	vdev->tag_ops = ops;
+	vdev->vnic_pcpu_stats = netdev_alloc_pcpu_stats(struct vnic_pcpu_stats);
+	KUNIT_ASSERT_NOT_NULL(test, vdev->vnic_pcpu_stats);
+
+	ports = kunit_kzalloc(test, struct_size(ports, dev, ops->max_ports), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, ports);
+	ports->nr = ops->max_ports;
+	ports->dev[VNIC_KUNIT_PORT] = ctx->vdev;
+
+	ctx->grp = kunit_kzalloc(test, sizeof(*ctx->grp), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, ctx->grp);
+	ctx->grp->real_dev = ctx->real_dev;
+	ctx->grp->tag_ops = ops;
+	RCU_INIT_POINTER(ctx->grp->ports, ports);
+
+	RCU_INIT_POINTER(ctx->real_dev->rx_handler_data, ctx->grp);
+
+	test->priv = ctx;
+	return 0;
+}
+
+static void vnic_kunit_exit(struct kunit *test)
+{
+	struct vnic_kunit_ctx *ctx = test->priv;
+
+	if (!ctx)
+		return;
+
+	if (ctx->vdev) {
+		free_percpu(vnic_dev_info(ctx->vdev)->vnic_pcpu_stats);
+		free_netdev(ctx->vdev);
+	}
+
+	if (ctx->real_dev)
+		free_netdev(ctx->real_dev);
+}
+
+static void vnic_kunit_parse_port(struct kunit *test)
+{
+	struct vnic_kunit_ctx *ctx = test->priv;
+	const struct vnic_tag_ops *ops = vnic_kunit_ops();
+	struct sk_buff *skb;
+	int port;
+
+	for (port = 0; port < 9; port++) {
+		skb = vnic_kunit_frame(ctx, port, true, 0);
+		KUNIT_ASSERT_NOT_NULL(test, skb);
+
+		KUNIT_EXPECT_EQ(test, ops->parse_port(skb), port);
+
+		kfree_skb(skb);
+	}
+}
+
+static void vnic_kunit_strip(struct kunit *test)
+{
+	struct vnic_kunit_ctx *ctx = test->priv;
+	const struct vnic_tag_ops *ops = vnic_kunit_ops();
+	struct sk_buff *skb;
+	unsigned int i;
+
+	skb = vnic_kunit_frame(ctx, VNIC_KUNIT_PORT, true, 0);
+	KUNIT_ASSERT_NOT_NULL(test, skb);
+
+	skb = ops->strip(skb, VNIC_KUNIT_PORT);
+	KUNIT_ASSERT_NOT_NULL(test, skb);
+
+	KUNIT_EXPECT_MEMEQ(test, eth_hdr(skb)->h_dest, vnic_kunit_da, ETH_ALEN);
+	KUNIT_EXPECT_MEMEQ(test, eth_hdr(skb)->h_source, vnic_kunit_sa, ETH_ALEN);
+	KUNIT_EXPECT_EQ(test, ntohs(eth_hdr(skb)->h_proto), ETH_P_IP);
+	KUNIT_EXPECT_EQ(test, ntohs(skb->protocol), ETH_P_IP);
+	KUNIT_EXPECT_PTR_EQ(test, skb->data, skb_mac_header(skb) + ETH_HLEN);
+	KUNIT_EXPECT_PTR_EQ(test, skb->data, skb_network_header(skb));
+	KUNIT_EXPECT_EQ(test, skb->len, VNIC_KUNIT_PAYLOAD);
+
+	for (i = 0; i < VNIC_KUNIT_PAYLOAD; i++)
+		KUNIT_EXPECT_EQ(test, skb->data[i], (u8)i);
+
+	kfree_skb(skb);
+}
+
+static void vnic_kunit_strip_csum_complete(struct kunit *test)
+{
+	struct vnic_kunit_ctx *ctx = test->priv;
+	const struct vnic_tag_ops *ops = vnic_kunit_ops();
+	struct sk_buff *skb;
+
+	skb = vnic_kunit_frame(ctx, VNIC_KUNIT_PORT, true, 0);
+	KUNIT_ASSERT_NOT_NULL(test, skb);
+
+	skb->ip_summed = CHECKSUM_COMPLETE;
+	skb->csum = csum_partial(skb->data, skb->len, 0);
+
+	skb = ops->strip(skb, VNIC_KUNIT_PORT);
+	KUNIT_ASSERT_NOT_NULL(test, skb);
+
+	KUNIT_EXPECT_EQ(test, skb->ip_summed, CHECKSUM_COMPLETE);
+	KUNIT_EXPECT_EQ(test, csum_fold(skb->csum),
+			csum_fold(csum_partial(skb->data, skb->len, 0)));
+
+	kfree_skb(skb);
+}
+
+static void vnic_kunit_strip_cloned(struct kunit *test)
+{
+	struct vnic_kunit_ctx *ctx = test->priv;
+	const struct vnic_tag_ops *ops = vnic_kunit_ops();
+	struct sk_buff *skb, *clone;
+	u8 frame[BRCM_PREPEND_LEN + ETH_HLEN];
+
+	skb = vnic_kunit_frame(ctx, VNIC_KUNIT_PORT, true, 0);
+	KUNIT_ASSERT_NOT_NULL(test, skb);
+
+	clone = skb_clone(skb, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, clone);
+	memcpy(frame, skb_mac_header(clone), sizeof(frame));
+
+	skb = ops->strip(skb, VNIC_KUNIT_PORT);
+	KUNIT_ASSERT_NOT_NULL(test, skb);
+
+	/* The clone, e.g. the one of a tap, still sees the tagged frame */
+	KUNIT_EXPECT_MEMEQ(test, skb_mac_header(clone), frame, sizeof(frame));
+	KUNIT_EXPECT_MEMEQ(test, eth_hdr(skb)->h_source, vnic_kunit_sa, ETH_ALEN);
+
+	kfree_skb(clone);
+	kfree_skb(skb);
+}
+
+static void vnic_kunit_insert(struct kunit *test)
+{
+	struct vnic_kunit_ctx *ctx = test->priv;
+	const struct vnic_tag_ops *ops = vnic_kunit_ops();
+	u64 tag = ops->build(VNIC_KUNIT_PORT);
+	struct sk_buff *skb;
+	unsigned char *head;
+
+	skb = vnic_kunit_frame(ctx, 0, false, 0);
+	KUNIT_ASSERT_NOT_NULL(test, skb);
+	skb_push(skb, ETH_HLEN);
+	head = skb->head;
+
+	KUNIT_ASSERT_EQ(test, ops->insert(skb, tag), 0);
+
+	/* Enough headroom, nothing reallocated */
+	KUNIT_EXPECT_PTR_EQ(test, skb->head, head);
+	KUNIT_EXPECT_EQ(test, skb->len, ops->tag_len + ETH_HLEN + VNIC_KUNIT_PAYLOAD);
+	KUNIT_EXPECT_PTR_EQ(test, skb_mac_header(skb), skb->data);
+
+	if (ops->tag_len == BRCM_PREPEND_LEN) {
+		KUNIT_EXPECT_EQ(test, get_unaligned((u32 *)(skb->data + BRCM_PREPEND_LEN - BRCM_TAG_LEN)), tag);
+		KUNIT_EXPECT_MEMEQ(test, skb->data + BRCM_PREPEND_LEN, vnic_kunit_da, ETH_ALEN);
+	} else {
+		KUNIT_EXPECT_MEMEQ(test, skb->data, vnic_kunit_da, ETH_ALEN);
+		KUNIT_EXPECT_MEMEQ(test, skb->data + ETH_ALEN, vnic_kunit_sa, ETH_ALEN);
+		KUNIT_EXPECT_EQ(test, get_unaligned((u32 *)(skb->data + 2 * ETH_ALEN)), tag);
+	}
+
+	kfree_skb(skb);
+}
+
+static void vnic_kunit_cascade_off(void *unused)
+{
+	vnic_brcm_kunit_cascade(-1);
+}
+
+/* A second switch behind VNIC_KUNIT_CASCADE, until the test ends */
+static unsigned int vnic_kunit_cascade(struct kunit *test)
+{
+	unsigned int chip_ports = vnic_brcm_kunit_cascade(VNIC_KUNIT_CASCADE);
+
+	KUNIT_ASSERT_EQ(test, kunit_add_action_or_reset(test, vnic_kunit_cascade_off, NULL), 0);
+
+	return chip_ports;
+}
+
+static void vnic_kunit_cascade_parse_port(struct kunit *test)
+{
+	struct vnic_kunit_ctx *ctx = test->priv;
+	const struct vnic_tag_ops *ops = vnic_kunit_ops();
+	unsigned int chip_ports = vnic_kunit_cascade(test);
+	int ports[2] = { VNIC_KUNIT_CASCADE };
+	struct sk_buff *skb;
+
+	for (ports[1] = 0; ports[1] < 9; ports[1]++) {
+		skb = vnic_kunit_stack(ctx, ports, 2, 0);
+		KUNIT_ASSERT_NOT_NULL(test, skb);
+
+		KUNIT_EXPECT_EQ(test, ops->parse_port(skb), chip_ports + ports[1]);
+
+		kfree_skb(skb);
+	}
+
+	/* Ports of the first switch keep their single tag */
+	skb = vnic_kunit_frame(ctx, VNIC_KUNIT_PORT, true, 0);
+	KUNIT_ASSERT_NOT_NULL(test, skb);
+	KUNIT_EXPECT_EQ(test, ops->parse_port(skb), VNIC_KUNIT_PORT);
+	kfree_skb(skb);
+}
+
+static void vnic_kunit_cascade_strip(struct kunit *test)
+{
+	struct vnic_kunit_ctx *ctx = test->priv;
+	const struct vnic_tag_ops *ops = vnic_kunit_ops();
+	unsigned int chip_ports = vnic_kunit_cascade(test);
+	int ports[2] = { VNIC_KUNIT_CASCADE, VNIC_KUNIT_PORT };
+	struct sk_buff *skb;
+	unsigned int i;
+
+	skb = vnic_kunit_stack(ctx, ports, 2, 0);
+	KUNIT_ASSERT_NOT_NULL(test, skb);
+
+	skb->ip_summed = CHECKSUM_COMPLETE;
+	skb->csum = csum_partial(skb->data, skb->len, 0);
+
+	skb = ops->strip(skb, chip_ports + VNIC_KUNIT_PORT);
+	KUNIT_ASSERT_NOT_NULL(test, skb);
+
+	/* Both tags gone at once */
+	KUNIT_EXPECT_MEMEQ(test, eth_hdr(skb)->h_dest, vnic_kunit_da, ETH_ALEN);
+	KUNIT_EXPECT_MEMEQ(test, eth_hdr(skb)->h_source, vnic_kunit_sa, ETH_ALEN);
+	KUNIT_EXPECT_EQ(test, ntohs(skb->protocol), ETH_P_IP);
+	KUNIT_EXPECT_PTR_EQ(test, skb->data, skb_mac_header(skb) + ETH_HLEN);
+	KUNIT_EXPECT_PTR_EQ(test, skb->data, skb_network_header(skb));
+	KUNIT_EXPECT_EQ(test, skb->len, VNIC_KUNIT_PAYLOAD);
+
+	for (i = 0; i < VNIC_KUNIT_PAYLOAD; i++)
+		KUNIT_EXPECT_EQ(test, skb->data[i], (u8)i);
+
+	KUNIT_EXPECT_EQ(test, skb->ip_summed, CHECKSUM_COMPLETE);
+	KUNIT_EXPECT_EQ(test, csum_fold(skb->csum),
+			csum_fold(csum_partial(skb->data, skb->len, 0)));
+
+	kfree_skb(skb);
+}
+
+static void vnic_kunit_cascade_insert(struct kunit *test)
+{
+	struct vnic_kunit_ctx *ctx = test->priv;
+	const struct vnic_tag_ops *ops = vnic_kunit_ops();
+	unsigned int chip_ports = vnic_kunit_cascade(test);
+	u64 tag = ops->build(chip_ports + VNIC_KUNIT_PORT);
+	unsigned int tag_len = ops->tag_len;
+	struct sk_buff *skb;
+	u8 *outer, *da;
+
+	/* To the cascade port of the first switch, then to the port of the second */
+	KUNIT_EXPECT_EQ(test, (u32)tag, (u32)ops->build(VNIC_KUNIT_CASCADE));
+	KUNIT_EXPECT_EQ(test, (u32)(tag >> 32), (u32)ops->build(VNIC_KUNIT_PORT));
+
+	skb = vnic_kunit_frame(ctx, 0, false, 0);
+	KUNIT_ASSERT_NOT_NULL(test, skb);
+	skb_push(skb, ETH_HLEN);
+
+	KUNIT_ASSERT_EQ(test, ops->insert(skb, tag), 0);
+
+	KUNIT_EXPECT_EQ(test, skb->len, 2 * tag_len + ETH_HLEN + VNIC_KUNIT_PAYLOAD);
+	KUNIT_EXPECT_PTR_EQ(test, skb_mac_header(skb), skb->data);
+
+	if (tag_len == BRCM_PREPEND_LEN) {
+		outer = skb->data + BRCM_PREPEND_LEN - BRCM_TAG_LEN;
+		da = skb->data + 2 * BRCM_PREPEND_LEN;
+	} else {
+		outer = skb->data + 2 * ETH_ALEN;
+		da = skb->data;
+		KUNIT_EXPECT_MEMEQ(test, da + ETH_ALEN, vnic_kunit_sa, ETH_ALEN);
+	}
+
+	KUNIT_EXPECT_MEMEQ(test, da, vnic_kunit_da, ETH_ALEN);
+	KUNIT_EXPECT_EQ(test, get_unaligned((u32 *)outer), (u32)tag);
+	KUNIT_EXPECT_EQ(test, get_unaligned((u32 *)(outer + tag_len)), (u32)(tag >> 32));
+
+	kfree_skb(skb);
+}
+
+/* An Atheros frame, the two header bytes as they are on the wire */
+static struct sk_buff *vnic_kunit_ar_frame(struct vnic_kunit_ctx *ctx, u8 hdr0, u8 hdr1)
+{
+	struct sk_buff *skb;
+	u8 *p;
+
+	skb = alloc_skb(NET_SKB_PAD + AR_TAG_LEN + ETH_HLEN + VNIC_KUNIT_PAYLOAD, GFP_KERNEL);
+	if (!skb)
+		return NULL;
+
+	skb_reserve(skb, NET_SKB_PAD);
+	p = skb_put_zero(skb, AR_TAG_LEN + ETH_HLEN + VNIC_KUNIT_PAYLOAD);
+
+	p[0] = hdr0;
+	p[1] = hdr1;
+	memcpy(p + AR_TAG_LEN, vnic_kunit_da, ETH_ALEN);
+	memcpy(p + AR_TAG_LEN + ETH_ALEN, vnic_kunit_sa, ETH_ALEN);
+	put_unaligned(htons(ETH_P_IP), (__be16 *)(p + AR_TAG_LEN + 2 * ETH_ALEN));
+
+	skb->protocol = eth_type_trans(skb, ctx->real_dev);
+
+	return skb;
+}
+
+static void vnic_kunit_ar_parse_port(struct kunit *test)
+{
+	const struct vnic_tag_ops *ops = vnic_tag_ops_get(VNIC_GRP_ID_ATHEROS);
+	struct vnic_kunit_ctx *ctx = test->priv;
+	struct sk_buff *skb;
+	int port;
+
+	for (port = 0; port < ops->max_ports; port++) {
+		skb = vnic_kunit_ar_frame(ctx, port, 0x80);
+		KUNIT_ASSERT_NOT_NULL(test, skb);
+
+		KUNIT_EXPECT_EQ(test, ops->parse_port(skb), port);
+
+		skb = ops->strip(skb, port);
+		KUNIT_EXPECT_MEMEQ(test, eth_hdr(skb)->h_dest, vnic_kunit_da, ETH_ALEN);
+		KUNIT_EXPECT_EQ(test, ntohs(skb->protocol), ETH_P_IP);
+
+		kfree_skb(skb);
+	}
+
+	/* Another version, and a management frame */
+	skb = vnic_kunit_ar_frame(ctx, VNIC_KUNIT_PORT, 0x40);
+	KUNIT_ASSERT_NOT_NULL(test, skb);
+	KUNIT_EXPECT_LT(test, ops->parse_port(skb), 0);
+	kfree_skb(skb);
+
+	skb = vnic_kunit_ar_frame(ctx, VNIC_KUNIT_PORT, 0x81);
+	KUNIT_ASSERT_NOT_NULL(test, skb);
+	KUNIT_EXPECT_LT(test, ops->parse_port(skb), 0);
+	kfree_skb(skb);
+}
+
+static void vnic_kunit_ar_insert(struct kunit *test)
+{
+	const struct vnic_tag_ops *ops = vnic_tag_ops_get(VNIC_GRP_ID_ATHEROS);
+	struct vnic_kunit_ctx *ctx = test->priv;
+	struct sk_buff *skb;
+
+	skb = vnic_kunit_frame(ctx, 0, false, 0);
+	KUNIT_ASSERT_NOT_NULL(test, skb);
+	skb_push(skb, ETH_HLEN);
+
+	KUNIT_ASSERT_EQ(test, ops->insert(skb, ops->tc_tag(ops->build(VNIC_KUNIT_PORT), 7)), 0);
+
+	/* From the CPU to the port, priority 3, version 2 */
+	KUNIT_EXPECT_PTR_EQ(test, skb_mac_header(skb), skb->data);
+	KUNIT_EXPECT_EQ(test, skb->data[0], 0x40 | VNIC_KUNIT_PORT);
+	KUNIT_EXPECT_EQ(test, skb->data[1], 0xb0);
+	KUNIT_EXPECT_MEMEQ(test, skb->data + AR_TAG_LEN, vnic_kunit_da, ETH_ALEN);
+
+	/* What goes out parses back */
+	skb->protocol = eth_type_trans(skb, ctx->real_dev);
+	KUNIT_EXPECT_EQ(test, ops->parse_port(skb), VNIC_KUNIT_PORT);
+
+	kfree_skb(skb);
+}
+
+static void vnic_kunit_get_dev(struct kunit *test)
+{
+	struct vnic_kunit_ctx *ctx = test->priv;
+	const struct vnic_tag_ops *ops = vnic_kunit_ops();
+
+	rcu_read_lock();
+	KUNIT_EXPECT_PTR_EQ(test, vnic_get_dev(ctx->grp, VNIC_KUNIT_PORT), ctx->vdev);
+	KUNIT_EXPECT_NULL(test, vnic_get_dev(ctx->grp, VNIC_KUNIT_PORT + 1));
+	KUNIT_EXPECT_NULL(test, vnic_get_dev(ctx->grp, ops->max_ports));
+	KUNIT_EXPECT_NULL(test, vnic_get_dev(ctx->grp, 255));
+	rcu_read_unlock();
+}
+
+KUNIT_DEFINE_ACTION_WRAPPER(vnic_kunit_free_netdev, free_netdev, struct net_device *);
+
+/*
+ * The group is made reachable from the control path for the move and
+ * taken back before the test returns, exit frees the devices first.
+ */
+static void vnic_kunit_port_move(struct kunit *test)
+{
+	struct vnic_kunit_ctx *ctx = test->priv;
+	const struct vnic_ports *init_ports;
+	struct vnic_ports *ports;
+	struct net_device *other;
+	int err;
+
+	other = alloc_etherdev(0);
+	KUNIT_ASSERT_NOT_NULL(test, other);
+	KUNIT_ASSERT_EQ(test, kunit_add_action_or_reset(test, vnic_kunit_free_netdev, other), 0);
+
+	/* The move frees the table it replaces, it can not be the test's own */
+	init_ports = rcu_dereference_protected(ctx->grp->ports, true);
+	ports = kmemdup(init_ports, struct_size(init_ports, dev, init_ports->nr), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, ports);
+
+	ports->dev[VNIC_KUNIT_PORT + 2] = other;
+	RCU_INIT_POINTER(ctx->grp->ports, ports);
+
+	rtnl_lock();
+
+	err = netdev_rx_handler_register(ctx->real_dev, vnic_skb_recv, ctx->grp);
+	if (!err) {
+		err = vnic_grp_kunit_link(ctx->grp);
+		if (err)
+			netdev_rx_handler_unregister(ctx->real_dev);
+	}
+
+	if (err) {
+		rtnl_unlock();
+		kfree(ports);
+		KUNIT_FAIL(test, "can not link the group: %d", err);
+		return;
+	}
+
+	KUNIT_EXPECT_EQ(test, vnic_port_move(ctx->vdev, VNIC_KUNIT_PORT + 1), 0);
+	KUNIT_EXPECT_EQ(test, vnic_dev_info(ctx->vdev)->vid, VNIC_KUNIT_PORT + 1);
+
+	rcu_read_lock();
+	KUNIT_EXPECT_NULL(test, vnic_get_dev(ctx->grp, VNIC_KUNIT_PORT));
+	KUNIT_EXPECT_PTR_EQ(test, vnic_get_dev(ctx->grp, VNIC_KUNIT_PORT + 1), ctx->vdev);
+	rcu_read_unlock();
+
+	/* An occupied port, nothing changes */
+	ports = rtnl_dereference(ctx->grp->ports);
+	KUNIT_EXPECT_EQ(test, vnic_port_move(ctx->vdev, VNIC_KUNIT_PORT + 2), -EEXIST);
+	KUNIT_EXPECT_PTR_EQ(test, rtnl_dereference(ctx->grp->ports), ports);
+	KUNIT_EXPECT_EQ(test, vnic_dev_info(ctx->vdev)->vid, VNIC_KUNIT_PORT + 1);
+
+	rcu_read_lock();
+	KUNIT_EXPECT_PTR_EQ(test, vnic_get_dev(ctx->grp, VNIC_KUNIT_PORT + 1), ctx->vdev);
+	KUNIT_EXPECT_PTR_EQ(test, vnic_get_dev(ctx->grp, VNIC_KUNIT_PORT + 2), other);
+	rcu_read_unlock();
+
+	vnic_grp_kunit_unlink(ctx->grp);
+	netdev_rx_handler_unregister(ctx->real_dev);
+	kfree(rtnl_dereference(ctx->grp->ports));
+
+	rtnl_unlock();
+}
+
+static int vnic_kunit_sample_attr(struct kunit *test, u32 rate)
+{
+	struct sk_buff *skb;
+	int err;
+
+	skb = alloc_skb(nla_total_size(sizeof(u32)), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, skb);
+	KUNIT_ASSERT_EQ(test, nla_put_u32(skb, IFLA_VNIC_SAMPLE, rate), 0);
+
+	err = nla_validate((struct nlattr *)skb->data, skb->len, vnic_link_ops.maxtype,
+			   vnic_link_ops.policy, NULL);
+
+	kfree_skb(skb);
+	return err;
+}
+
+/* A rate as "ip link" sends it, then set on the port and taken back */
+static void vnic_kunit_sample_rate(struct kunit *test)
+{
+	struct vnic_kunit_ctx *ctx = test->priv;
+	struct vnic_device *vdev = vnic_dev_info(ctx->vdev);
+
+	KUNIT_EXPECT_EQ(test, vnic_kunit_sample_attr(test, 0), 0);
+	KUNIT_EXPECT_EQ(test, vnic_kunit_sample_attr(test, 1000), 0);
+	KUNIT_EXPECT_EQ(test, vnic_kunit_sample_attr(test, VNIC_SAMPLE_RATE_MAX), 0);
+	KUNIT_EXPECT_EQ(test, vnic_kunit_sample_attr(test, VNIC_SAMPLE_RATE_MAX + 1), -ERANGE);
+
+	rtnl_lock();
+
+	KUNIT_EXPECT_EQ(test, vnic_sample_set(ctx->vdev, 1000), 0);
+	KUNIT_EXPECT_EQ(test, vdev->sample_rate, 1000);
+	KUNIT_EXPECT_TRUE(test, static_key_enabled(&vnic_sample_enabled));
+
+	KUNIT_EXPECT_EQ(test, vnic_sample_set(ctx->vdev, 0), 0);
+	KUNIT_EXPECT_EQ(test, vdev->sample_rate, 0);
+
+	rtnl_unlock();
+}
+
+static rx_handler_result_t vnic_kunit_recv(struct sk_buff **pskb)
+{
+	rx_handler_result_t ret;
+
+	rcu_read_lock();
+	ret = vnic_skb_recv(pskb);
+	rcu_read_unlock();
+
+	return ret;
+}
+
+static void vnic_kunit_recv_known_port(struct kunit *test)
+{
+	struct vnic_kunit_ctx *ctx = test->priv;
+	struct sk_buff *skb;
+
+	skb = vnic_kunit_frame(ctx, VNIC_KUNIT_PORT, true, 0);
+	KUNIT_ASSERT_NOT_NULL(test, skb);
+
+	KUNIT_ASSERT_EQ(test, vnic_kunit_recv(&skb), RX_HANDLER_ANOTHER);
+	KUNIT_EXPECT_PTR_EQ(test, skb->dev, ctx->vdev);
+	KUNIT_EXPECT_EQ(test, skb->pkt_type, PACKET_HOST);
+	KUNIT_EXPECT_EQ(test, ntohs(skb->protocol), ETH_P_IP);
+	KUNIT_EXPECT_EQ(test, skb->len, VNIC_KUNIT_PAYLOAD);
+
+	kfree_skb(skb);
+}
+
+static void vnic_kunit_recv_unknown_port(struct kunit *test)
+{
+	struct vnic_kunit_ctx *ctx = test->priv;
+	struct sk_buff *skb;
+
+	skb = vnic_kunit_frame(ctx, VNIC_KUNIT_PORT + 1, true, 0);
+	KUNIT_ASSERT_NOT_NULL(test, skb);
+
+	/* Dropped and freed by the handler */
+	KUNIT_EXPECT_EQ(test, vnic_kunit_recv(&skb), RX_HANDLER_CONSUMED);
+}
+
+static void vnic_kunit_recv_short(struct kunit *test)
+{
+	struct vnic_kunit_ctx *ctx = test->priv;
+	const struct vnic_tag_ops *ops = vnic_kunit_ops();
+	struct sk_buff *skb;
+
+	/* The tag ends one byte early */
+	skb = vnic_kunit_frame(ctx, VNIC_KUNIT_PORT, true, ETH_HLEN + ops->rx_pull - 1);
+	KUNIT_ASSERT_NOT_NULL(test, skb);
+
+	KUNIT_EXPECT_EQ(test, vnic_kunit_recv(&skb), RX_HANDLER_CONSUMED);
+}
+
+static void vnic_kunit_recv_untagged(struct kunit *test)
+{
+	struct vnic_kunit_ctx *ctx = test->priv;
+	struct sk_buff *skb, *orig;
+
+	if (!vnic_kunit_ops()->rx_proto)
+		kunit_skip(test, "every frame is tagged with this profile");
+
+	skb = orig = vnic_kunit_frame(ctx, 0, false, 0);
+	KUNIT_ASSERT_NOT_NULL(test, skb);
+
+	KUNIT_EXPECT_EQ(test, vnic_kunit_recv(&skb), RX_HANDLER_PASS);
+	KUNIT_EXPECT_PTR_EQ(test, skb, orig);
+	KUNIT_EXPECT_PTR_EQ(test, skb->dev, ctx->real_dev);
+
+	kfree_skb(skb);
+}
+
+static void vnic_kunit_recv_shared(struct kunit *test)
+{
+	struct vnic_kunit_ctx *ctx = test->priv;
+	struct sk_buff *skb, *orig;
+	u8 frame[BRCM_PREPEND_LEN + ETH_HLEN];
+
+	skb = orig = vnic_kunit_frame(ctx, VNIC_KUNIT_PORT, true, 0);
+	KUNIT_ASSERT_NOT_NULL(test, skb);
+	memcpy(frame, skb_mac_header(orig), sizeof(frame));
+
+	/* A tap holds the second reference */
+	skb_get(orig);
+
+	KUNIT_ASSERT_EQ(test, vnic_kunit_recv(&skb), RX_HANDLER_ANOTHER);
+	KUNIT_EXPECT_PTR_NE(test, skb, orig);
+	KUNIT_EXPECT_PTR_EQ(test, skb->dev, ctx->vdev);
+	KUNIT_EXPECT_PTR_EQ(test, orig->dev, ctx->real_dev);
+	KUNIT_EXPECT_MEMEQ(test, skb_mac_header(orig), frame, sizeof(frame));
+
+	kfree_skb(skb);
+	kfree_skb(orig);
+}
+
+static void vnic_kunit_bench_batch(struct kunit *test, struct sk_buff **skbs, bool tagged)
+{
+	struct vnic_kunit_ctx *ctx = test->priv;
+	unsigned int i;
+
+	for (i = 0; i < VNIC_BENCH_BATCH; i++) {
+		skbs[i] = vnic_kunit_frame(ctx, VNIC_KUNIT_PORT, tagged, 0);
+		KUNIT_ASSERT_NOT_NULL(test, skbs[i]);
+	}
+}
+
+static void vnic_kunit_bench_free(struct sk_buff **skbs)
+{
+	unsigned int i;
+
+	for (i = 0; i < VNIC_BENCH_BATCH; i++)
+		kfree_skb(skbs[i]);
+}
+
+/*
+ * ns per packet of every stage, over VNIC_BENCH_ROUNDS batches of
+ * VNIC_BENCH_BATCH frames.  Allocation and freeing are not timed.
+ */
+static void vnic_kunit_bench(struct kunit *test)
+{
+	struct vnic_kunit_ctx *ctx = test->priv;
+	const struct vnic_tag_ops *ops = vnic_kunit_ops();
+	u64 parse_ns = 0, lookup_ns = 0, strip_ns = 0, insert_ns = 0, recv_ns = 0;
+	u64 tag = ops->build(VNIC_KUNIT_PORT);
+	struct sk_buff **skbs;
+	unsigned int round, i, hits = 0;
+	u64 t;
+
+	skbs = kunit_kcalloc(test, VNIC_BENCH_BATCH, sizeof(*skbs), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, skbs);
+
+	for (round = 0; round < VNIC_BENCH_ROUNDS; round++) {
+		vnic_kunit_bench_batch(test, skbs, true);
+
+		t = ktime_get_ns();
+		for (i = 0; i < VNIC_BENCH_BATCH; i++)
+			hits += ops->parse_port(skbs[i]) == VNIC_KUNIT_PORT;
+		parse_ns += ktime_get_ns() - t;
+
+		rcu_read_lock();
+		t = ktime_get_ns();
+		for (i = 0; i < VNIC_BENCH_BATCH; i++)
+			hits += vnic_get_dev(ctx->grp, VNIC_KUNIT_PORT) == ctx->vdev;
+		lookup_ns += ktime_get_ns() - t;
+		rcu_read_unlock();
+
+		t = ktime_get_ns();
+		for (i = 0; i < VNIC_BENCH_BATCH; i++)
+			skbs[i] = ops->strip(skbs[i], VNIC_KUNIT_PORT);
+		strip_ns += ktime_get_ns() - t;
+
+		vnic_kunit_bench_free(skbs);
+
+		vnic_kunit_bench_batch(test, skbs, false);
+		for (i = 0; i < VNIC_BENCH_BATCH; i++)
+			skb_push(skbs[i], ETH_HLEN);
+
+		t = ktime_get_ns();
+		for (i = 0; i < VNIC_BENCH_BATCH; i++)
+			hits += !ops->insert(skbs[i], tag);
+		insert_ns += ktime_get_ns() - t;
+
+		vnic_kunit_bench_free(skbs);
+
+		vnic_kunit_bench_batch(test, skbs, true);
+
+		rcu_read_lock();
+		t = ktime_get_ns();
+		for (i = 0; i < VNIC_BENCH_BATCH; i++)
+			hits += vnic_skb_recv(&skbs[i]) == RX_HANDLER_ANOTHER;
+		recv_ns += ktime_get_ns() - t;
+		rcu_read_unlock();
+
+		vnic_kunit_bench_free(skbs);
+	}
+
+	KUNIT_EXPECT_EQ(test, hits, 4 * VNIC_BENCH_ROUNDS * VNIC_BENCH_BATCH);
+
+#define VNIC_NS_PER_PKT(ns) div_u64(ns, VNIC_BENCH_ROUNDS * VNIC_BENCH_BATCH)
+	kunit_info(test, "parse_port %llu ns/pkt\n", VNIC_NS_PER_PKT(parse_ns));
+	kunit_info(test, "get_dev    %llu ns/pkt\n", VNIC_NS_PER_PKT(lookup_ns));
+	kunit_info(test, "strip      %llu ns/pkt\n", VNIC_NS_PER_PKT(strip_ns));
+	kunit_info(test, "insert     %llu ns/pkt\n", VNIC_NS_PER_PKT(insert_ns));
+	kunit_info(test, "skb_recv   %llu ns/pkt\n", VNIC_NS_PER_PKT(recv_ns));
+#undef VNIC_NS_PER_PKT
+}
+
+static struct kunit_case vnic_kunit_cases[] = {
+	KUNIT_CASE(vnic_kunit_parse_port),
+	KUNIT_CASE(vnic_kunit_strip),
+	KUNIT_CASE(vnic_kunit_strip_csum_complete),
+	KUNIT_CASE(vnic_kunit_strip_cloned),
+	KUNIT_CASE(vnic_kunit_insert),
+	KUNIT_CASE(vnic_kunit_cascade_parse_port),
+	KUNIT_CASE(vnic_kunit_cascade_strip),
+	KUNIT_CASE(vnic_kunit_cascade_insert),
+	KUNIT_CASE(vnic_kunit_ar_parse_port),
+	KUNIT_CASE(vnic_kunit_ar_insert),
+	KUNIT_CASE(vnic_kunit_get_dev),
+	KUNIT_CASE(vnic_kunit_port_move),
+	KUNIT_CASE(vnic_kunit_sample_rate),
+	KUNIT_CASE(vnic_kunit_recv_known_port),
+	KUNIT_CASE(vnic_kunit_recv_unknown_port),
+	KUNIT_CASE(vnic_kunit_recv_short),
+	KUNIT_CASE(vnic_kunit_recv_untagged),
+	KUNIT_CASE(vnic_kunit_recv_shared),
+	KUNIT_CASE_SLOW(vnic_kunit_bench),
+	{}
+};
+
+static struct kunit_suite vnic_kunit_suite = {
+	.name       = "vnic",
+	.init       = vnic_kunit_init,
+	.exit       = vnic_kunit_exit,
+	.test_cases = vnic_kunit_cases,
+};
+
+kunit_test_suite(vnic_kunit_suite);
@@ -0,0 +1,355 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  vnic_netlink.c
+ *
+ *    Description:  rtnetlink "vnic" link type, with bulk creation of port ranges
+ *
+ * =====================================================================================
+ */
+
+#include <linux/netdevice.h>
+#include <linux/etherdevice.h>
+#include <linux/ctype.h>
+#include <net/rtnetlink.h>
+
+#include "vnic_core.h"
+#include "vnic_dev.h"
+#include "vnic_netlink.h"
+#include "vnic_sample.h"
+
+/* Past the s16 bounds of NLA_POLICY_MAX() */
+static const struct netlink_range_validation vnic_sample_range = {
+	.max = VNIC_SAMPLE_RATE_MAX,
+};
+
+static const struct nla_policy vnic_nl_policy[IFLA_VNIC_MAX + 1] = {
+	[IFLA_VNIC_PORT]      = { .type = NLA_U32 },
+	[IFLA_VNIC_COUNT]     = { .type = NLA_U32 },
+	[IFLA_VNIC_PROTO]     = { .type = NLA_U8 },
+	[IFLA_VNIC_DSCP_PRIO] = NLA_POLICY_EXACT_LEN(64),
+	[IFLA_VNIC_SAMPLE]    = NLA_POLICY_FULL_RANGE(NLA_U32, &vnic_sample_range),
+	[IFLA_VNIC_PRIO_TC]   = NLA_POLICY_EXACT_LEN(TC_BITMASK + 1),
+};
+
+static int vnic_nl_validate_dscp(struct nlattr *data[], struct netlink_ext_ack *extack)
+{
+	const u8 *map;
+	int i;
+
+	if (!data[IFLA_VNIC_DSCP_PRIO])
+		return 0;
+
+	map = nla_data(data[IFLA_VNIC_DSCP_PRIO]);
+	for (i = 0; i < 64; i++) {
+		if (map[i] > TC_BITMASK) {
+			NL_SET_ERR_MSG_MOD(extack, "priority out of range");
+			return -ERANGE;
+		}
+	}
+
+	return 0;
+}
+
+static int vnic_nl_validate_prio_tc(struct nlattr *data[], struct netlink_ext_ack *extack)
+{
+	const u8 *map;
+	int i;
+
+	if (!data[IFLA_VNIC_PRIO_TC])
+		return 0;
+
+	map = nla_data(data[IFLA_VNIC_PRIO_TC]);
+	for (i = 0; i <= TC_BITMASK; i++) {
+		if (map[i] >= VNIC_TAG_TCS) {
+			NL_SET_ERR_MSG_MOD(extack, "traffic class out of range");
+			return -ERANGE;
+		}
+	}
+
+	return 0;
+}
+
+static int vnic_nl_validate(struct nlattr *tb[], struct nlattr *data[],
+			    struct netlink_ext_ack *extack)
+{
+	if (tb[IFLA_ADDRESS]) {
+		if (nla_len(tb[IFLA_ADDRESS]) != ETH_ALEN)
+			return -EINVAL;
+		if (!is_valid_ether_addr(nla_data(tb[IFLA_ADDRESS])))
+			return -EADDRNOTAVAIL;
+	}
+
+	/* Also run for changelink, newlink insists on the port */
+	if (!data)
+		return 0;
+
+	/* The port range is checked once the tag format is known, at newlink or changelink */
+	if (data[IFLA_VNIC_PROTO] && !vnic_tag_ops_get(nla_get_u8(data[IFLA_VNIC_PROTO]))) {
+		NL_SET_ERR_MSG_MOD(extack, "unknown tag format");
+		return -EPROTONOSUPPORT;
+	}
+
+	return vnic_nl_validate_dscp(data, extack) ?: vnic_nl_validate_prio_tc(data, extack);
+}
+
+/* The tag decides how many ports the switch can have */
+static int vnic_nl_check_ports(const struct vnic_tag_ops *ops, u32 port, u32 count,
+			       struct netlink_ext_ack *extack)
+{
+	if (!count || port >= ops->max_ports || count > ops->max_ports - port) {
+		NL_SET_ERR_MSG_MOD(extack, "switch port out of range");
+		return -ERANGE;
+	}
+
+	return 0;
+}
+
+/* Per port settings, for newlink and changelink */
+static int vnic_nl_apply(struct net_device *dev, struct nlattr *data[])
+{
+	if (data[IFLA_VNIC_DSCP_PRIO])
+		vnic_dev_set_dscp_map(dev, nla_data(data[IFLA_VNIC_DSCP_PRIO]));
+
+	if (data[IFLA_VNIC_PRIO_TC])
+		vnic_dev_set_prio_tc(dev, nla_data(data[IFLA_VNIC_PRIO_TC]));
+
+	if (data[IFLA_VNIC_SAMPLE])
+		return vnic_sample_set(dev, nla_get_u32(data[IFLA_VNIC_SAMPLE]));
+
+	return 0;
+}
+
+/* "brcm0" -> "brcm", the bulk ports are named <prefix><port> like the ioctl ones */
+static void vnic_nl_name_prefix(const struct net_device *dev, char *prefix)
+{
+	int len = strlen(dev->name);
+
+	while (len > 0 && isdigit(dev->name[len - 1]))
+		len--;
+
+	memcpy(prefix, dev->name, len);
+	prefix[len] = '\0';
+}
+
+/*
+ * A bulk port, made from the same link attributes (MTU, address, ...) and
+ * in the same namespace as the first one
+ */
+static struct net_device *vnic_nl_port_create(struct net_device *dev, struct nlattr *tb[],
+					      struct net_device *real_dev, const char *prefix,
+					      u32 port, u8 vtype, struct netlink_ext_ack *extack)
+{
+	struct net_device *vdev;
+	char name[IFNAMSIZ];
+	int err;
+
+	if (snprintf(name, IFNAMSIZ, "%s%u", prefix, port) >= IFNAMSIZ)
+		return ERR_PTR(-EINVAL);
+
+	vdev = rtnl_create_link(dev_net(dev), name, NET_NAME_USER, &vnic_link_ops, tb, extack);
+	if (IS_ERR(vdev))
+		return vdev;
+
+	err = vnic_port_register(real_dev, vdev, port, vtype);
+	if (err < 0) {
+		free_netdev(vdev);
+		return ERR_PTR(err);
+	}
+
+	err = rtnl_configure_link(vdev, NULL, 0, NULL);
+	if (err < 0) {
+		vnic_port_unregister(vdev, NULL);
+		return ERR_PTR(err);
+	}
+
+	return vdev;
+}
+
+static int vnic_nl_newlink(struct net *src_net, struct net_device *dev,
+			   struct nlattr *tb[], struct nlattr *data[],
+			   struct netlink_ext_ack *extack)
+{
+	struct net_device *real_dev, *vdev;
+	char prefix[IFNAMSIZ];
+	u8 vtype = VNIC_GRP_ID_BROADCOM;
+	u32 port, count = 1, i;
+	LIST_HEAD(list);
+	int err;
+
+	if (!tb[IFLA_LINK]) {
+		NL_SET_ERR_MSG_MOD(extack, "real device not specified");
+		return -EINVAL;
+	}
+
+	if (!data || !data[IFLA_VNIC_PORT]) {
+		NL_SET_ERR_MSG_MOD(extack, "switch port not specified");
+		return -EINVAL;
+	}
+
+	real_dev = __dev_get_by_index(src_net, nla_get_u32(tb[IFLA_LINK]));
+	if (!real_dev) {
+		NL_SET_ERR_MSG_MOD(extack, "real device not found");
+		return -ENODEV;
+	}
+
+	port = nla_get_u32(data[IFLA_VNIC_PORT]);
+	if (data[IFLA_VNIC_COUNT])
+		count = nla_get_u32(data[IFLA_VNIC_COUNT]);
+	if (data[IFLA_VNIC_PROTO])
+		vtype = nla_get_u8(data[IFLA_VNIC_PROTO]);
+
+	err = vnic_nl_check_ports(vnic_tag_ops_get(vtype), port, count, extack);
+	if (err < 0)
+		return err;
+
+	err = vnic_port_register(real_dev, dev, port, vtype);
+	if (err < 0)
+		return err;
+
+	i = 1;
+	err = vnic_nl_apply(dev, data);
+	if (err < 0)
+		goto err_unwind;
+
+	/* Bulk mode, the rest of the range is added in the same rtnl section */
+	vnic_nl_name_prefix(dev, prefix);
+
+	for (; i < count; i++) {
+		vdev = vnic_nl_port_create(dev, tb, real_dev, prefix, port + i, vtype, extack);
+		if (IS_ERR(vdev)) {
+			err = PTR_ERR(vdev);
+			goto err_unwind;
+		}
+
+		dev_set_group(vdev, dev->group);
+
+		err = vnic_nl_apply(vdev, data);
+		if (err < 0) {
+			i++;
+			goto err_unwind;
+		}
+	}
+
+	return 0;
+
+err_unwind:
+	NL_SET_ERR_MSG_MOD(extack, "failed to set up the whole port range");
+
+	while (--i > 0) {
+		vdev = vnic_get_port_rtnl(real_dev, port + i);
+		if (vdev)
+			vnic_port_unregister(vdev, &list);
+	}
+
+	vnic_port_unregister(dev, &list);
+	unregister_netdevice_many(&list);
+
+	return err;
+}
+
+/* The port may move within the switch, the tag format is fixed */
+static int vnic_nl_changelink(struct net_device *dev, struct nlattr *tb[],
+			      struct nlattr *data[], struct netlink_ext_ack *extack)
+{
+	int err;
+
+	if (data && (data[IFLA_VNIC_COUNT] || data[IFLA_VNIC_PROTO])) {
+		NL_SET_ERR_MSG_MOD(extack, "port range and tag format can not be changed");
+		return -EOPNOTSUPP;
+	}
+
+	if (data && data[IFLA_VNIC_PORT]) {
+		err = vnic_nl_check_ports(vnic_dev_info(dev)->tag_ops,
+					  nla_get_u32(data[IFLA_VNIC_PORT]), 1, extack);
+		if (err < 0)
+			return err;
+
+		err = vnic_port_move(dev, nla_get_u32(data[IFLA_VNIC_PORT]));
+		if (err < 0) {
+			NL_SET_ERR_MSG_MOD(extack, "can not move to this switch port");
+			return err;
+		}
+	}
+
+	return data ? vnic_nl_apply(dev, data) : 0;
+}
+
+static void vnic_nl_dellink(struct net_device *dev, struct list_head *head)
+{
+	vnic_port_unregister(dev, head);
+}
+
+static size_t vnic_nl_get_size(const struct net_device *dev)
+{
+	return nla_total_size(sizeof(u32)) +	/* IFLA_VNIC_PORT */
+	       nla_total_size(sizeof(u8)) +	/* IFLA_VNIC_PROTO */
+	       nla_total_size(64) +		/* IFLA_VNIC_DSCP_PRIO */
+	       nla_total_size(sizeof(u32)) +	/* IFLA_VNIC_SAMPLE */
+	       nla_total_size(TC_BITMASK + 1);	/* IFLA_VNIC_PRIO_TC */
+}
+
+static int vnic_nl_fill_info(struct sk_buff *skb, const struct net_device *dev)
+{
+	struct vnic_device *vdev = vnic_dev_info((struct net_device *)dev);
+
+	if (nla_put_u32(skb, IFLA_VNIC_PORT, vdev->vid) ||
+	    nla_put_u8(skb, IFLA_VNIC_PROTO, vdev->vtype))
+		return -EMSGSIZE;
+
+	if (vdev->dscp_map &&
+	    nla_put(skb, IFLA_VNIC_DSCP_PRIO, sizeof(vdev->dscp_prio), vdev->dscp_prio))
+		return -EMSGSIZE;
+
+	if (vdev->sample_rate && nla_put_u32(skb, IFLA_VNIC_SAMPLE, vdev->sample_rate))
+		return -EMSGSIZE;
+
+	if (memchr_inv(vdev->prio_tc, 0, sizeof(vdev->prio_tc)) &&
+	    nla_put(skb, IFLA_VNIC_PRIO_TC, sizeof(vdev->prio_tc), vdev->prio_tc))
+		return -EMSGSIZE;
+
+	return 0;
+}
+
+/*
+ * The real device is not known here yet.  Allocate as many queues as
+ * rtnl_create_link() allows, vnic_dev_init() uses the real device's share.
+ */
+static unsigned int vnic_nl_get_num_queues(void)
+{
+	return min_t(unsigned int, num_possible_cpus(), 4096);
+}
+
+static struct net *vnic_nl_get_link_net(const struct net_device *dev)
+{
+	return dev_net(vnic_dev_info((struct net_device *)dev)->real_dev);
+}
+
+struct rtnl_link_ops vnic_link_ops __read_mostly = {
+	.kind              = "vnic",
+	.maxtype           = IFLA_VNIC_MAX,
+	.policy            = vnic_nl_policy,
+	.priv_size         = sizeof(struct vnic_device),
+	.setup             = vnic_netdev_setup,
+	.validate          = vnic_nl_validate,
+	.newlink           = vnic_nl_newlink,
+	.changelink        = vnic_nl_changelink,
+	.dellink           = vnic_nl_dellink,
+	.get_size          = vnic_nl_get_size,
+	.fill_info         = vnic_nl_fill_info,
+	.get_link_net      = vnic_nl_get_link_net,
+	.get_num_tx_queues = vnic_nl_get_num_queues,
+	.get_num_rx_queues = vnic_nl_get_num_queues,
+};
+
+int
+vnic_netlink_init (void)
+{
+	return rtnl_link_register(&vnic_link_ops);
+}
+
+void
+vnic_netlink_fini (void)
+{
+	rtnl_link_unregister(&vnic_link_ops);
+}
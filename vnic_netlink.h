@@ -0,0 +1,34 @@
+#ifndef __VNIC_NETLINK_INC__
+#define __VNIC_NETLINK_INC__
+
+#include <net/rtnetlink.h>
+
+/*
+ *  ip link add link eth0 name brcm0 type vnic port 0 [count 8] [proto 0|1]
+ *                                             [dscp_prio <64 priorities>]
+ *                                             [sample <N>]
+ *                                             [prio_tc <16 classes>]
+ *
+ *  With IFLA_VNIC_COUNT the ports port .. port + count - 1 are created in
+ *  one rtnl section, named after the prefix of the given name.  They share
+ *  its interface group, so "ip link del group N" removes them in one go.
+ */
+enum {
+	IFLA_VNIC_UNSPEC,
+	IFLA_VNIC_PORT,		/* u32: switch port of the virtual device   */
+	IFLA_VNIC_COUNT,	/* u32: number of consecutive ports to add  */
+	IFLA_VNIC_PROTO,	/* u8:  tag format, VNIC_GRP_ID_*           */
+	IFLA_VNIC_DSCP_PRIO,	/* u8[64]: DSCP -> priority, all 0 is off   */
+	IFLA_VNIC_SAMPLE,	/* u32: sample 1 in N frames, 0 is off      */
+	IFLA_VNIC_PRIO_TC,	/* u8[16]: priority -> traffic class        */
+	__IFLA_VNIC_MAX,
+};
+
+#define IFLA_VNIC_MAX (__IFLA_VNIC_MAX - 1)
+
+extern struct rtnl_link_ops vnic_link_ops;
+
+int vnic_netlink_init (void);
+void vnic_netlink_fini (void);
+
+#endif
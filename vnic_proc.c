@@ -19,12 +19,15 @@
 #include <linux/seq_file.h>
 
 #include "vnic_proc.h"
+#include "vnic_sample.h"
 
 #define D_NAME "vnic"     /* /proc/net/vnic/<virtual device>  */
 #define C_NAME "config"   /* /proc/net/vnic/config            */
+#define S_NAME "sample"   /* /proc/net/vnic/sample, mmap only */
 
 static struct proc_dir_entry *proc_vnic_dir;
 static struct proc_dir_entry *proc_vnic_conf;
+static struct proc_dir_entry *proc_vnic_sample;
 
 static void *vnic_seq_start(struct seq_file *seq, loff_t *pos);
 static void *vnic_seq_next(struct seq_file *seq, void *v, loff_t *pos);
@@ -45,25 +48,23 @@ static int vnic_seq_open(struct inode *inode, struct file *file)
 	return seq_open(file, &vnic_seq_ops);
 }
 
-static const struct file_operations vnic_config_fops = {
-	.owner   = THIS_MODULE,
-	.open    = vnic_seq_open,
-	.read    = seq_read,
-	.llseek  = seq_lseek,
-	.release = seq_release,
+static const struct proc_ops vnic_config_fops = {
+	.proc_open    = vnic_seq_open,
+	.proc_read    = seq_read,
+	.proc_lseek   = seq_lseek,
+	.proc_release = seq_release,
 };
 
 static int vnic_dev_seq_open(struct inode *inode, struct file *file)
 {
-	return single_open(file, vnic_dev_seq_show, PDE(inode)->data);
+	return single_open(file, vnic_dev_seq_show, pde_data(inode));
 }
 
-static const struct file_operations vnic_dev_fops = {
-	.owner   = THIS_MODULE,
-	.open    = vnic_dev_seq_open,
-	.read    = seq_read,
-	.llseek  = seq_lseek,
-	.release = single_release,
+static const struct proc_ops vnic_dev_fops = {
+	.proc_open    = vnic_dev_seq_open,
+	.proc_read    = seq_read,
+	.proc_lseek   = seq_lseek,
+	.proc_release = single_release,
 };
 
 
@@ -79,16 +80,13 @@ vnic_proc_add_dev (struct net_device *vnic_dev)
 {
 	struct vnic_device *vdev = vnic_dev_info(vnic_dev);
 
-	vdev->dent = create_proc_entry(vnic_dev->name, S_IFREG | S_IRUSR | S_IWUSR, proc_vnic_dir);
+	vdev->dent = proc_create_data(vnic_dev->name, S_IFREG | S_IRUSR | S_IWUSR, proc_vnic_dir,
+				      &vnic_dev_fops, vnic_dev);
 
 	if (!vdev->dent) 
 		return -ENOBUFS;
 
-	vdev->dent->data = vnic_dev;
-
-#ifdef VNIC_PROC_DEBUG
-	printk(KERN_INFO "vnic_proc_add_dev, device -:%s:- being added. \n", vnic_dev->name);
-#endif
+	vnic_dbg("vnic_proc_add_dev, device -:%s:- being added. \n", vnic_dev->name);
 
 	return 0;
 }	
@@ -106,12 +104,10 @@ int
 vnic_proc_rem_dev (struct net_device *vnic_dev)
 {
 	if (vnic_dev_info(vnic_dev)->dent) {
-		remove_proc_entry(vnic_dev_info(vnic_dev)->dent->name, proc_vnic_dir);
+		proc_remove(vnic_dev_info(vnic_dev)->dent);
 		vnic_dev_info(vnic_dev)->dent = NULL;
 
-#ifdef VNIC_PROC_DEBUG
-	printk(KERN_INFO "vnic_proc_rem_dev, device -:%s:- being removed. \n", vnic_dev->name);
-#endif
+	vnic_dbg("vnic_proc_rem_dev, device -:%s:- being removed. \n", vnic_dev->name);
 	}
 
 	return 0;
@@ -130,15 +126,20 @@ vnic_proc_rem_dev (struct net_device *vnic_dev)
 int
 vnic_proc_init (void)
 {
-	proc_vnic_dir = proc_mkdir(D_NAME, proc_net);
+	proc_vnic_dir = proc_mkdir(D_NAME, init_net.proc_net);
 
 	if (proc_vnic_dir) {
 		
-		proc_vnic_conf = create_proc_entry(C_NAME, S_IFREG | S_IRUSR | S_IWUSR, proc_vnic_dir);
+		proc_vnic_conf = proc_create(C_NAME, S_IFREG | S_IRUSR | S_IWUSR, proc_vnic_dir,
+					     &vnic_config_fops);
+
+		proc_vnic_sample = proc_create(S_NAME, S_IFREG | S_IRUSR | S_IWUSR, proc_vnic_dir,
+					       &vnic_sample_fops);
+		if (!proc_vnic_sample)
+			printk(KERN_WARNING "Can not create /proc/net/" D_NAME "/" S_NAME "\n");
 
 		if (proc_vnic_conf) {
 			printk(KERN_ERR "Create /proc/net/" C_NAME "\n");
-			proc_vnic_conf->proc_fops = &vnic_config_fops;
 			return 0;
 		}
 
@@ -167,8 +168,12 @@ vnic_proc_cleanup (void)
 		remove_proc_entry(C_NAME, proc_vnic_dir);
 	}
 
+	if (proc_vnic_sample) {
+		remove_proc_entry(S_NAME, proc_vnic_dir);
+	}
+
 	if (proc_vnic_dir) {
-		proc_net_remove(D_NAME);
+		remove_proc_entry(D_NAME, init_net.proc_net);
 	}
 }
 /* -----  end of function vnic_proc_exit(void)  ----- */
@@ -178,12 +183,12 @@ static void *vnic_seq_start(struct seq_file *seq, loff_t *pos)
 	struct net_device *dev;
 	loff_t i = 1;
 
-	read_lock(&dev_base_lock);
+	rcu_read_lock();
 
 	if (*pos == 0)
 		return SEQ_START_TOKEN;
 
-	for_each_netdev(dev) {
+	for_each_netdev_rcu(&init_net, dev) {
 		if (!is_vnic_dev(dev))
 			continue;
 
@@ -198,14 +203,14 @@ static void *vnic_seq_next(struct seq_file *seq, void *v, loff_t *pos)
 {
 	struct net_device *dev;
 
-	++pos;
+	++*pos;
 
 	dev = (struct net_device *)v;
 
 	if (v == SEQ_START_TOKEN)
-		dev = net_device_entry(&dev_base_head);
+		dev = net_device_entry(&init_net.dev_base_head);
 
-	for_each_netdev_continue(dev) {
+	for_each_netdev_continue_rcu(&init_net, dev) {
 		if (!is_vnic_dev(dev))
 			continue;
 
@@ -217,7 +222,7 @@ static void *vnic_seq_next(struct seq_file *seq, void *v, loff_t *pos)
 
 static void vnic_seq_stop(struct seq_file *seq, void *v)
 {
-	read_unlock(&dev_base_lock);
+	rcu_read_unlock();
 }
 
 static int vnic_seq_show(struct seq_file *seq, void *v)
@@ -227,7 +232,7 @@ static int vnic_seq_show(struct seq_file *seq, void *v)
 	}else {
 		struct net_device *dev = v;
 		struct vnic_device *vdev = vnic_dev_info(dev);
-		seq_printf(seq, "%-15s| %d | %s \n", dev->name, vdev->vid, vdev->real_dev->name);
+		seq_printf(seq, "%-15s| %u | %s \n", dev->name, vdev->vid, vdev->real_dev->name);
 	}
 
 	return 0;
@@ -0,0 +1,175 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  vnic_sample.c
+ *
+ *    Description:  1-in-N packet sampling of the virtual ports into per-CPU rings
+ *                  mapped by user space, see vnic_sample.h
+ *
+ * =====================================================================================
+ */
+
+#include <linux/netdevice.h>
+#include <linux/skbuff.h>
+#include <linux/vmalloc.h>
+#include <linux/random.h>
+#include <linux/timekeeping.h>
+#include <linux/mm.h>
+
+#include "vnic_core.h"
+#include "vnic_sample.h"
+
+DEFINE_STATIC_KEY_FALSE(vnic_sample_enabled);
+
+/* Allocated when a port first samples, kept until the module goes */
+static DEFINE_PER_CPU(void *, vnic_sample_ring);
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  __vnic_sample
+ *  Description:  Take a sample of @skb, called with BH off on the CPU owning the
+ *                ring: the RX and TX paths of one CPU never nest, no lock needed.
+ *                RX frames are untagged already, TX frames not tagged yet.
+ * =====================================================================================
+ */
+void
+__vnic_sample (struct net_device *dev, const struct sk_buff *skb, u8 dir)
+{
+	struct vnic_device *vdev = vnic_dev_info(dev);
+	void *ring = this_cpu_read(vnic_sample_ring);
+	struct vnic_sample_hdr *hdr = ring;
+	u32 rate = READ_ONCE(vdev->sample_rate);
+	unsigned int mac_len = 0, caplen;
+	struct vnic_sample *s;
+	u32 head;
+
+	/* Random gaps of mean rate, periodic traffic does not alias with them */
+	this_cpu_write(vdev->vnic_pcpu_stats->sample_skip,
+		       rate > 1 ? get_random_u32_below(2 * rate - 1) + 1 : 1);
+
+	if (unlikely(!ring || !rate))
+		return;
+
+	head = hdr->head;
+	if (head - smp_load_acquire(&hdr->tail) >= VNIC_SAMPLE_SLOTS) {
+		hdr->dropped++;
+		return;
+	}
+
+	if (skb_mac_header_was_set(skb))
+		mac_len = skb->data - skb_mac_header(skb);
+
+	caplen = min_t(unsigned int, skb->len + mac_len, VNIC_SAMPLE_CAPLEN);
+
+	s = ring + VNIC_SAMPLE_SLOTS_OFF + (head % VNIC_SAMPLE_SLOTS) * sizeof(*s);
+	s->tstamp  = ktime_get_ns();
+	s->ifindex = dev->ifindex;
+	s->port    = vdev->vid;
+	s->dir     = dir;
+	s->caplen  = caplen;
+	s->len     = skb->len + mac_len;
+	s->rate    = rate;
+
+	memcpy(s->data, skb_mac_header(skb), min(mac_len, caplen));
+	if (caplen > mac_len)
+		skb_copy_bits(skb, 0, s->data + mac_len, caplen - mac_len);
+
+	smp_store_release(&hdr->head, head + 1);
+}
+
+/* -----  end of function __vnic_sample  ----- */
+
+static int
+vnic_sample_alloc_rings (void)
+{
+	struct vnic_sample_hdr *hdr;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if (per_cpu(vnic_sample_ring, cpu))
+			continue;
+
+		hdr = vmalloc_user(VNIC_SAMPLE_RING_SIZE);
+		if (!hdr)
+			return -ENOMEM;
+
+		hdr->slots = VNIC_SAMPLE_SLOTS;
+		smp_store_release(&per_cpu(vnic_sample_ring, cpu), hdr);
+	}
+
+	return 0;
+}
+
+/*
+ * ===  FUNCTION  ======================================================================
+ *         Name:  vnic_sample_set
+ *  Description:  Sample 1 in @rate frames of the port, 0 stops.  rtnl must be held.
+ * =====================================================================================
+ */
+int
+vnic_sample_set (struct net_device *dev, u32 rate)
+{
+	struct vnic_device *vdev = vnic_dev_info(dev);
+	u32 old = vdev->sample_rate;
+	int cpu, err;
+
+	if (rate == old)
+		return 0;
+
+	if (rate && !old) {
+		err = vnic_sample_alloc_rings();
+		if (err < 0)
+			return err;
+	}
+
+	for_each_possible_cpu(cpu)
+		per_cpu_ptr(vdev->vnic_pcpu_stats, cpu)->sample_skip = rate;
+
+	WRITE_ONCE(vdev->sample_rate, rate);
+
+	if (rate && !old)
+		static_branch_inc(&vnic_sample_enabled);
+	else if (!rate)
+		static_branch_dec(&vnic_sample_enabled);
+
+	return 0;
+}
+
+/* -----  end of function vnic_sample_set  ----- */
+
+/* The page offset picks the CPU, one whole ring per mapping */
+static int
+vnic_sample_mmap (struct file *file, struct vm_area_struct *vma)
+{
+	unsigned long pages = VNIC_SAMPLE_RING_SIZE >> PAGE_SHIFT;
+	unsigned long cpu = vma->vm_pgoff / pages;
+	void *ring;
+
+	if (vma->vm_pgoff % pages || vma->vm_end - vma->vm_start != VNIC_SAMPLE_RING_SIZE)
+		return -EINVAL;
+
+	if (cpu >= nr_cpu_ids || !cpu_possible(cpu))
+		return -EINVAL;
+
+	ring = smp_load_acquire(&per_cpu(vnic_sample_ring, cpu));
+	if (!ring)
+		return -ENODATA;
+
+	return remap_vmalloc_range(vma, ring, 0);
+}
+
+const struct proc_ops vnic_sample_fops = {
+	.proc_mmap = vnic_sample_mmap,
+};
+
+/* After the last port, mappings still held keep their pages */
+void
+vnic_sample_fini (void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		vfree(per_cpu(vnic_sample_ring, cpu));
+		per_cpu(vnic_sample_ring, cpu) = NULL;
+	}
+}
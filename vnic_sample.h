@@ -0,0 +1,86 @@
+#ifndef __VNIC_SAMPLE_INC__
+#define __VNIC_SAMPLE_INC__
+
+#include <linux/types.h>
+
+/*
+ *  Packet sampling, shared with the readers in user space.
+ *
+ *  A port samples 1 in N of its frames (IFLA_VNIC_SAMPLE) in both
+ *  directions, into a ring of the CPU it runs on.  Each CPU ring is mapped
+ *  from /proc/net/vnic/sample at offset cpu * VNIC_SAMPLE_RING_SIZE.  It
+ *  starts with a struct vnic_sample_hdr, the slots follow at
+ *  VNIC_SAMPLE_SLOTS_OFF.  The kernel fills slot head % VNIC_SAMPLE_SLOTS
+ *  and then releases head, user space reads up to head and releases tail.
+ *  A full ring drops the sample and counts it.
+ */
+#define VNIC_SAMPLE_SLOTS      1024
+#define VNIC_SAMPLE_CAPLEN     104
+#define VNIC_SAMPLE_SLOTS_OFF  4096
+#define VNIC_SAMPLE_RATE_MAX   (1U << 24)
+
+enum {
+	VNIC_SAMPLE_RX,
+	VNIC_SAMPLE_TX,
+};
+
+struct vnic_sample_hdr {
+	__u32 head;		/* written by the kernel */
+	__u32 pad0[15];
+	__u32 tail;		/* written by user space */
+	__u32 pad1[15];
+	__u32 slots;
+	__u32 dropped;
+};
+
+struct vnic_sample {
+	__u64 tstamp;		/* CLOCK_MONOTONIC ns          */
+	__u32 ifindex;		/* virtual device              */
+	__u16 port;		/* switch port                 */
+	__u8  dir;		/* VNIC_SAMPLE_RX, _TX         */
+	__u8  caplen;		/* bytes of data               */
+	__u32 len;		/* untagged frame length       */
+	__u32 rate;		/* 1 in rate, when taken       */
+	__u8  data[VNIC_SAMPLE_CAPLEN];	/* from the MAC header */
+};
+
+#ifdef __KERNEL__
+
+#include <linux/netdevice.h>
+#include <linux/jump_label.h>
+#include <linux/proc_fs.h>
+
+#include "vnic_core.h"
+
+#define VNIC_SAMPLE_RING_SIZE \
+	PAGE_ALIGN(VNIC_SAMPLE_SLOTS_OFF + VNIC_SAMPLE_SLOTS * sizeof(struct vnic_sample))
+
+DECLARE_STATIC_KEY_FALSE(vnic_sample_enabled);
+
+extern const struct proc_ops vnic_sample_fops;
+
+void __vnic_sample(struct net_device *dev, const struct sk_buff *skb, u8 dir);
+int vnic_sample_set(struct net_device *dev, u32 rate);
+void vnic_sample_fini(void);
+
+/*
+ * Patched out while no port samples.  Otherwise a port without a rate
+ * costs one test, a sampled one a per-CPU countdown as well.
+ */
+static __always_inline void
+vnic_sample (struct net_device *dev, const struct sk_buff *skb, u8 dir)
+{
+	struct vnic_device *vdev;
+
+	if (!static_branch_unlikely(&vnic_sample_enabled))
+		return;
+
+	vdev = vnic_dev_info(dev);
+	if (READ_ONCE(vdev->sample_rate) &&
+	    unlikely(!this_cpu_dec_return(vdev->vnic_pcpu_stats->sample_skip)))
+		__vnic_sample(dev, skb, dir);
+}
+
+#endif /* __KERNEL__ */
+
+#endif
@@ -0,0 +1,588 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  vnic_tag.c
+ *
+ *    Description:  Switch tag formats: parse, strip and insert of the Broadcom tag
+ *                  and of the Atheros header
+ *
+ * =====================================================================================
+ */
+
+#include <linux/netdevice.h>
+#include <linux/etherdevice.h>
+#include <linux/if_ether.h>
+#include <linux/bitfield.h>
+#include <linux/unaligned.h>
+#include <linux/jump_label.h>
+#include <linux/module.h>
+#include <net/gro.h>
+
+#include "vnic_core.h"
+#include "vnic_tag.h"
+
+/* Protocol of the frame now that eth_hdr() points at the untagged header */
+static inline void
+vnic_tag_set_protocol (struct sk_buff *skb)
+{
+	skb_reset_network_header(skb);
+
+	if (likely(eth_proto_is_802_3(eth_hdr(skb)->h_proto)))
+		skb->protocol = eth_hdr(skb)->h_proto;
+	else
+		skb->protocol = htons(ETH_P_802_2);
+}
+
+/*
+ *  Broadcom chip profiles, one is picked with the "brcm_chip" parameter at
+ *  load time.  The layout is turned into static branches, so the parser of
+ *  the selected profile runs without testing it per packet.
+ */
+enum vnic_brcm_layout {
+	VNIC_BRCM_LAYOUT_TYPE,		/* 0x8874 type + opcode/TC + port, behind SA    */
+	VNIC_BRCM_LAYOUT_TAG,		/* opcode/TC + port map, behind SA, no type     */
+	VNIC_BRCM_LAYOUT_PREPEND,	/* padding + TAG layout, in front of DA         */
+};
+
+struct vnic_brcm_profile {
+	const char *name;
+	enum vnic_brcm_layout layout;
+	unsigned int tag_len;		/* bytes on the wire                    */
+	unsigned char opcode_byte;	/* byte of the tag holding opcode/TC    */
+	unsigned char port_mask;	/* source port field of byte 3          */
+};
+
+static const struct vnic_brcm_profile vnic_brcm_profiles[] = {
+	{ "bcm53101", VNIC_BRCM_LAYOUT_TYPE,    BRCM_TAG_LEN,     2, 0xff },
+	{ "bcm53115", VNIC_BRCM_LAYOUT_TYPE,    BRCM_TAG_LEN,     2, 0xff },
+	{ "bcm53125", VNIC_BRCM_LAYOUT_TAG,     BRCM_TAG_LEN,     0, 0x1f },
+	{ "bcm5301x", VNIC_BRCM_LAYOUT_TAG,     BRCM_TAG_LEN,     0, 0x1f },
+	{ "bcm58xx",  VNIC_BRCM_LAYOUT_PREPEND, BRCM_PREPEND_LEN, 0, 0x1f },
+};
+
+static char *brcm_chip = "bcm53115";
+module_param(brcm_chip, charp, 0444);
+MODULE_PARM_DESC(brcm_chip, "Broadcom switch: bcm53101, bcm53115, bcm53125, bcm5301x or bcm58xx");
+
+static int brcm_cascade = -1;
+module_param(brcm_cascade, int, 0444);
+MODULE_PARM_DESC(brcm_cascade, "Port a second switch of the same chip is cascaded on, -1 for none");
+
+static const struct vnic_brcm_profile *vnic_brcm_prof __ro_after_init;
+
+static DEFINE_STATIC_KEY_FALSE(vnic_brcm_prepend);	/* tag in front of the addresses   */
+static DEFINE_STATIC_KEY_FALSE(vnic_brcm_untyped);	/* no type, ingress opcode checked */
+static DEFINE_STATIC_KEY_FALSE(vnic_brcm_cascaded);	/* second switch behind brcm_cascade */
+
+/* Ports of one switch, those of the second one are numbered after them */
+static __always_inline unsigned int
+vnic_brcm_chip_ports (void)
+{
+	return vnic_brcm_prof->port_mask + 1;
+}
+
+/* Tags in a built stack, a tag is never all zero */
+static __always_inline unsigned int
+vnic_brcm_depth (u64 tag)
+{
+	return tag >> 32 ? 2 : 1;
+}
+
+static __always_inline const u8 *
+vnic_brcm_tag (const struct sk_buff *skb)
+{
+	if (static_branch_unlikely(&vnic_brcm_prepend))
+		return skb_mac_header(skb) + BRCM_PREPEND_LEN - BRCM_TAG_LEN;
+
+	return skb_mac_header(skb) + 2 * ETH_ALEN;
+}
+
+/* 
+ * ===  FUNCTION  ======================================================================
+ *         Name:  vnic_brcm_parse_port
+ *  Description:  Frames forwarded to the CPU carry opcode 0, anything else is a
+ *                management frame of the switch.
+ * =====================================================================================
+ */
+
+static __always_inline int
+vnic_brcm_tag_port (const u8 *tag)
+{
+	if (static_branch_unlikely(&vnic_brcm_untyped)) {
+		if (unlikely(tag[vnic_brcm_prof->opcode_byte] & BRCM_OPCODE_MASK))
+			return -EINVAL;
+	}
+
+	return tag[3] & vnic_brcm_prof->port_mask;
+}
+
+INDIRECT_CALLABLE_SCOPE int
+vnic_brcm_parse_port (const struct sk_buff *skb)
+{
+	const u8 *tag = vnic_brcm_tag(skb);
+	int port = vnic_brcm_tag_port(tag);
+
+	/* The first switch tagged a frame of the second one in front of its tag */
+	if (static_branch_unlikely(&vnic_brcm_cascaded) && port == brcm_cascade) {
+		port = vnic_brcm_tag_port(tag + vnic_brcm_prof->tag_len);
+		if (port >= 0)
+			port += vnic_brcm_chip_ports();
+	}
+
+	return port;
+}	
+
+/* -----  end of function vnic_brcm_parse_port  ----- */
+
+/* 
+ * ===  FUNCTION  ======================================================================
+ *         Name:  vnic_brcm_strip
+ *  Description:  Remove the brcm tag which added by switch chip before send the skb to
+ *                IP layer.  skb->data points right behind the Ethernet header the real
+ *                device parsed and the tag is already in the linear area.
+ *
+ *                A prepended tag only moves the header offsets.  Behind the source
+ *                address, only the header is unshared and the addresses are moved
+ *                over the tag in place.  The checksum of the pulled bytes is taken
+ *                out of CHECKSUM_COMPLETE.  Returns NULL if the skb had to be dropped.
+ *                Ports of a cascaded switch have both tags removed at once.
+ * =====================================================================================
+ */
+
+INDIRECT_CALLABLE_SCOPE struct sk_buff*
+vnic_brcm_strip (struct sk_buff *skb, unsigned int port)
+{
+	unsigned int len = vnic_brcm_prof->tag_len;
+
+	if (static_branch_unlikely(&vnic_brcm_cascaded) && port >= vnic_brcm_chip_ports())
+		len *= 2;
+
+	if (static_branch_unlikely(&vnic_brcm_prepend)) {
+		skb_pull_rcsum(skb, len);
+		skb->mac_header += len;
+
+		vnic_tag_set_protocol(skb);
+		return skb;
+	}
+
+	if (unlikely(skb_cow_head(skb, 0))) {
+		kfree_skb(skb);
+		return NULL;
+	}
+
+	skb_pull_rcsum(skb, len);
+
+	memmove(skb->data - ETH_HLEN, skb->data - ETH_HLEN - len, 2 * ETH_ALEN);
+	skb->mac_header += len;
+
+	vnic_tag_set_protocol(skb);
+
+	return skb;
+}
+
+/* -----  end of function vnic_brcm_strip  ----- */
+
+static u64
+vnic_brcm_build_map (u32 map)
+{
+	u8 tag[BRCM_TAG_LEN] = { 0 };
+
+	tag[0] = BRCM_TAG_OPCODE_EGRESS;
+	tag[2] = (map >> 8) & 0x01;
+	tag[3] = map & 0xff;
+
+	return get_unaligned((u32 *)tag);
+}
+
+/* The traffic class sits below the opcode, in the profile's opcode byte */
+static u32
+vnic_brcm_tc_one (u32 tag, unsigned int tc)
+{
+	u8 *b = (u8 *)&tag;
+
+	b[vnic_brcm_prof->opcode_byte] &= ~BRCM_TC_MASK;
+	b[vnic_brcm_prof->opcode_byte] |= FIELD_PREP(BRCM_TC_MASK, tc);
+
+	return tag;
+}
+
+/* Both switches of a cascade queue the frame in the same class */
+static u64
+vnic_brcm_tc_tag (u64 tag, unsigned int tc)
+{
+	u64 inner = tag >> 32;
+
+	if (inner)
+		inner = vnic_brcm_tc_one(inner, tc);
+
+	return vnic_brcm_tc_one(tag, tc) | inner << 32;
+}
+
+/* Egress tags address a port map, except for the 0x8874 type layout */
+static u32
+vnic_brcm_build_one (unsigned int port)
+{
+	if (vnic_brcm_prof->layout == VNIC_BRCM_LAYOUT_TYPE)
+		return (__force u32)htonl((u32)BRCM_TAG_TYPE << 16 | BRCM_TAG_OPCODE_EGRESS << 8 | port);
+
+	return vnic_brcm_build_map(port < BRCM_MAP_PORTS ? BIT(port) : 0);
+}
+
+/* A port of the second switch is reached through the cascade port of the first */
+static u64
+vnic_brcm_build (unsigned int port)
+{
+	if (port < vnic_brcm_chip_ports())
+		return vnic_brcm_build_one(port);
+
+	return vnic_brcm_build_one(brcm_cascade) |
+	       (u64)vnic_brcm_build_one(port - vnic_brcm_chip_ports()) << 32;
+}
+
+/* 
+ * ===  FUNCTION  ======================================================================
+ *         Name:  vnic_brcm_push
+ *  Description:  Write the egress brcm tag stack in the bytes in front of the frame at
+ *                data, outermost tag first
+ * =====================================================================================
+ */
+
+INDIRECT_CALLABLE_SCOPE void *
+vnic_brcm_push (void *data, u64 tag)
+{
+	unsigned int depth = vnic_brcm_depth(tag);
+	unsigned int i;
+
+	if (static_branch_unlikely(&vnic_brcm_prepend)) {
+		data -= depth * BRCM_PREPEND_LEN;
+		for (i = 0; i < depth; i++, tag >>= 32) {
+			memset(data + i * BRCM_PREPEND_LEN, 0, BRCM_PREPEND_LEN - BRCM_TAG_LEN);
+			put_unaligned((u32)tag, (u32 *)(data + (i + 1) * BRCM_PREPEND_LEN - BRCM_TAG_LEN));
+		}
+	} else {
+		data -= depth * BRCM_TAG_LEN;
+		memmove(data, data + depth * BRCM_TAG_LEN, 2 * ETH_ALEN);
+		for (i = 0; i < depth; i++, tag >>= 32)
+			put_unaligned((u32)tag, (u32 *)(data + 2 * ETH_ALEN + i * BRCM_TAG_LEN));
+	}
+
+	return data;
+}
+
+/* -----  end of function vnic_brcm_push  ----- */
+
+/* 
+ * ===  FUNCTION  ======================================================================
+ *         Name:  vnic_brcm_insert
+ *  Description:  Insert the egress brcm tag.  The virtual device asks for the tag
+ *                length of headroom, so skb_cow_head() only reallocates when the
+ *                header is cloned.
+ * =====================================================================================
+ */
+
+INDIRECT_CALLABLE_SCOPE int
+vnic_brcm_insert (struct sk_buff *skb, u64 tag)
+{
+	unsigned int len = vnic_brcm_depth(tag) * vnic_brcm_prof->tag_len;
+
+	if (unlikely(skb_cow_head(skb, len)))
+		return -ENOMEM;
+
+	vnic_brcm_push(skb->data, tag);
+	skb_push(skb, len);
+
+	skb_reset_mac_header(skb);
+
+	return 0;
+}
+
+/* -----  end of function vnic_brcm_insert  ----- */
+
+/* Length, type and pull are filled in from the profile by vnic_tag_init() */
+struct vnic_tag_ops vnic_brcm_tag_ops __ro_after_init = {
+	.name       = "brcm",
+	.gid        = VNIC_GRP_ID_BROADCOM,
+	.parse_port = vnic_brcm_parse_port,
+	.strip      = vnic_brcm_strip,
+	.build      = vnic_brcm_build,
+	.insert     = vnic_brcm_insert,
+	.push       = vnic_brcm_push,
+	.tc_tag     = vnic_brcm_tc_tag,
+};
+
+/*
+ *  GRO through the 0x8874 tag, on the NAPI of the real device.  Behind the
+ *  type the tag is laid out like a VLAN header: opcode and port take the
+ *  place of the TCI and the type of the frame follows.  Frames of one port
+ *  are coalesced like untagged ones, vnic_skb_recv() gets them as one skb.
+ *  A cascaded tag is one more pass through here.
+ */
+struct vnic_brcm_gro_hdr {
+	__be16 opport;
+	__be16 proto;
+};
+
+static struct sk_buff *
+vnic_brcm_gro_receive (struct list_head *head, struct sk_buff *skb)
+{
+	const struct packet_offload *ptype;
+	struct vnic_brcm_gro_hdr *hdr, *hdr2;
+	unsigned int off = skb_gro_offset(skb);
+	struct sk_buff *pp = NULL, *p;
+	int flush = 1;
+
+	hdr = skb_gro_header(skb, off + sizeof(*hdr), off);
+	if (unlikely(!hdr))
+		goto out;
+
+	ptype = gro_find_receive_by_type(hdr->proto);
+	if (!ptype)
+		goto out;
+
+	flush = 0;
+
+	list_for_each_entry(p, head, list) {
+		if (!NAPI_GRO_CB(p)->same_flow)
+			continue;
+
+		hdr2 = (struct vnic_brcm_gro_hdr *)(p->data + off);
+		if (hdr->opport != hdr2->opport || hdr->proto != hdr2->proto)
+			NAPI_GRO_CB(p)->same_flow = 0;
+	}
+
+	skb_gro_pull(skb, sizeof(*hdr));
+	skb_gro_postpull_rcsum(skb, hdr, sizeof(*hdr));
+
+	pp = call_gro_receive(ptype->callbacks.gro_receive, head, skb);
+
+out:
+	skb_gro_flush_final(skb, pp, flush);
+
+	return pp;
+}
+
+static int
+vnic_brcm_gro_complete (struct sk_buff *skb, int nhoff)
+{
+	struct vnic_brcm_gro_hdr *hdr = (struct vnic_brcm_gro_hdr *)(skb->data + nhoff);
+	struct packet_offload *ptype;
+
+	ptype = gro_find_complete_by_type(hdr->proto);
+	if (!ptype)
+		return -ENOENT;
+
+	return ptype->callbacks.gro_complete(skb, nhoff + sizeof(*hdr));
+}
+
+static struct packet_offload vnic_brcm_offload __read_mostly = {
+	.type     = cpu_to_be16(BRCM_TAG_TYPE),
+	.priority = 10,
+	.callbacks = {
+		.gro_receive  = vnic_brcm_gro_receive,
+		.gro_complete = vnic_brcm_gro_complete,
+	},
+};
+
+/* 
+ * ===  FUNCTION  ======================================================================
+ *         Name:  vnic_ar_parse_port
+ *  Description:  The header is in front of the addresses the real device parsed, it
+ *                is always within the linear area.  Management frames (type != 0)
+ *                are not for the virtual ports.
+ * =====================================================================================
+ */
+
+INDIRECT_CALLABLE_SCOPE int
+vnic_ar_parse_port (const struct sk_buff *skb)
+{
+	u16 hdr = get_unaligned_le16(skb_mac_header(skb));
+
+	if (unlikely(FIELD_GET(AR_HDR_VERSION_MASK, hdr) != AR_HDR_VERSION ||
+		     FIELD_GET(AR_HDR_TYPE_MASK, hdr)))
+		return -EINVAL;
+
+	return FIELD_GET(AR_HDR_PORT_MASK, hdr);
+}
+
+/* -----  end of function vnic_ar_parse_port  ----- */
+
+/* 
+ * ===  FUNCTION  ======================================================================
+ *         Name:  vnic_ar_strip
+ *  Description:  The real Ethernet header starts AR_TAG_LEN further, only the header
+ *                offsets move, nothing is written.
+ * =====================================================================================
+ */
+
+INDIRECT_CALLABLE_SCOPE struct sk_buff*
+vnic_ar_strip (struct sk_buff *skb, unsigned int port)
+{
+	skb_pull_rcsum(skb, AR_TAG_LEN);
+	skb->mac_header += AR_TAG_LEN;
+
+	vnic_tag_set_protocol(skb);
+
+	return skb;
+}
+
+/* -----  end of function vnic_ar_strip  ----- */
+
+static u64
+vnic_ar_build (unsigned int port)
+{
+	return FIELD_PREP(AR_HDR_VERSION_MASK, AR_HDR_VERSION) | AR_HDR_FROM_CPU |
+	       FIELD_PREP(AR_HDR_PORT_MASK, port);
+}
+
+/* Two priority bits, the upper ones of the traffic class */
+static u64
+vnic_ar_tc_tag (u64 tag, unsigned int tc)
+{
+	return (tag & ~AR_HDR_PRIO_MASK) | FIELD_PREP(AR_HDR_PRIO_MASK, tc >> 1);
+}
+
+INDIRECT_CALLABLE_SCOPE void *
+vnic_ar_push (void *data, u64 tag)
+{
+	data -= AR_TAG_LEN;
+	put_unaligned_le16(tag, data);
+
+	return data;
+}
+
+INDIRECT_CALLABLE_SCOPE int
+vnic_ar_insert (struct sk_buff *skb, u64 tag)
+{
+	if (unlikely(skb_cow_head(skb, AR_TAG_LEN)))
+		return -ENOMEM;
+
+	vnic_ar_push(skb->data, tag);
+	skb_push(skb, AR_TAG_LEN);
+
+	skb_reset_mac_header(skb);
+
+	return 0;
+}
+
+const struct vnic_tag_ops vnic_ar_tag_ops = {
+	.name       = "atheros",
+	.gid        = VNIC_GRP_ID_ATHEROS,
+	.tag_len    = AR_TAG_LEN,
+	.rx_pull    = AR_TAG_LEN,
+	.rx_proto   = 0,
+	.max_ports  = AR_HDR_PORT_MASK + 1,
+	.parse_port = vnic_ar_parse_port,
+	.strip      = vnic_ar_strip,
+	.build      = vnic_ar_build,
+	.insert     = vnic_ar_insert,
+	.push       = vnic_ar_push,
+	.tc_tag     = vnic_ar_tc_tag,
+};
+
+static const struct vnic_tag_ops *vnic_tag_ops_table[] = {
+	[VNIC_GRP_ID_BROADCOM] = &vnic_brcm_tag_ops,
+	[VNIC_GRP_ID_ATHEROS]  = &vnic_ar_tag_ops,
+};
+
+const struct vnic_tag_ops *
+vnic_tag_ops_get (unsigned char gid)
+{
+	if (gid >= ARRAY_SIZE(vnic_tag_ops_table))
+		return NULL;
+
+	return vnic_tag_ops_table[gid];
+}
+
+/* 
+ * ===  FUNCTION  ======================================================================
+ *         Name:  vnic_tag_init
+ *  Description:  Apply the Broadcom chip profile picked at load time
+ * =====================================================================================
+ */
+
+int __init
+vnic_tag_init (void)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(vnic_brcm_profiles); i++) {
+		if (!strcmp(brcm_chip, vnic_brcm_profiles[i].name))
+			vnic_brcm_prof = &vnic_brcm_profiles[i];
+	}
+
+	if (!vnic_brcm_prof) {
+		printk(KERN_ERR "vnic: unknown Broadcom chip %s.\n", brcm_chip);
+		return -EINVAL;
+	}
+
+	vnic_brcm_tag_ops.tag_len = vnic_brcm_prof->tag_len;
+
+	switch (vnic_brcm_prof->layout) {
+		case VNIC_BRCM_LAYOUT_TYPE:
+			vnic_brcm_tag_ops.rx_pull  = BRCM_TAG_LEN;
+			vnic_brcm_tag_ops.rx_proto = htons(BRCM_TAG_TYPE);
+			vnic_brcm_tag_ops.rx_gro   = true;
+			break;
+
+		case VNIC_BRCM_LAYOUT_TAG:
+			vnic_brcm_tag_ops.rx_pull  = BRCM_TAG_LEN;
+			static_branch_enable(&vnic_brcm_untyped);
+			break;
+
+		case VNIC_BRCM_LAYOUT_PREPEND:
+			vnic_brcm_tag_ops.rx_pull  = BRCM_PREPEND_LEN;
+			static_branch_enable(&vnic_brcm_untyped);
+			static_branch_enable(&vnic_brcm_prepend);
+			break;
+	}
+
+	vnic_brcm_tag_ops.max_ports = vnic_brcm_chip_ports();
+
+	if (brcm_cascade >= 0) {
+		if (brcm_cascade >= vnic_brcm_chip_ports()) {
+			printk(KERN_ERR "vnic: no cascade port %d on %s.\n", brcm_cascade, brcm_chip);
+			return -EINVAL;
+		}
+
+		/* Room and pull for both tags, ports of both switches */
+		vnic_brcm_tag_ops.tag_len   *= 2;
+		vnic_brcm_tag_ops.rx_pull   += vnic_brcm_prof->tag_len;
+		vnic_brcm_tag_ops.max_ports *= 2;
+		static_branch_enable(&vnic_brcm_cascaded);
+	}
+
+	if (vnic_brcm_tag_ops.rx_gro)
+		dev_add_offload(&vnic_brcm_offload);
+
+	if (vnic_brcm_prof->layout != VNIC_BRCM_LAYOUT_TYPE) {
+		vnic_brcm_tag_ops.map_ports = BRCM_MAP_PORTS;
+		vnic_brcm_tag_ops.build_map = vnic_brcm_build_map;
+	}
+
+	return 0;
+}
+
+/* -----  end of function vnic_tag_init  ----- */
+
+#if IS_ENABLED(CONFIG_KUNIT)
+/* Cascade behind @port for the tests, -1 for none.  Returns the ports of one switch */
+unsigned int
+vnic_brcm_kunit_cascade (int port)
+{
+	brcm_cascade = port;
+
+	if (port >= 0)
+		static_branch_enable(&vnic_brcm_cascaded);
+	else
+		static_branch_disable(&vnic_brcm_cascaded);
+
+	return vnic_brcm_chip_ports();
+}
+#endif
+
+void
+vnic_tag_fini (void)
+{
+	if (vnic_brcm_tag_ops.rx_gro)
+		dev_remove_offload(&vnic_brcm_offload);
+}
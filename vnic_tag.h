@@ -0,0 +1,119 @@
+#ifndef __VNIC_TAG_INC__
+#define __VNIC_TAG_INC__
+
+#include <linux/skbuff.h>
+#include <linux/indirect_call_wrapper.h>
+
+/*
+ *  Broadcom tags, the layout depends on the chip profile (vnic_tag.c).
+ *
+ *  Behind the source address, with a type (BCM53101, BCM53115):
+ *
+ *     |  type 0x8874 (16)  |  opcode/TC (8)  |  port (8)  |
+ *
+ *  Behind the source address, without a type (BCM53125, BCM5301x), or
+ *  prepended to the destination address behind 4 bytes of padding (BCM58xx):
+ *
+ *     |  opcode (3) TC (3) - (2)  |  - (8)  |  port map 8 (8)  |  port / port map 7:0 (8)  |
+ */
+#define BRCM_TAG_LEN             4
+#define BRCM_PREPEND_LEN         8
+#define BRCM_TAG_TYPE            0x8874
+#define BRCM_TAG_OPCODE_EGRESS   0x20
+#define BRCM_OPCODE_MASK         0xe0
+#define BRCM_MAP_PORTS           9
+#define BRCM_TC_MASK             0x1c
+
+/*
+ *  The Atheros (AR8216/AR8316) header is prepended to the destination
+ *  address, little endian: the version is in the second byte on the wire,
+ *  0x80 for a normal frame.
+ *
+ *     | version (2) | prio (2) | - (1) | type (3) | bc (1) | cpu (1) | - (2) | port (4) |
+ */
+#define AR_TAG_LEN               2
+#define AR_HDR_VERSION           2
+#define AR_HDR_VERSION_MASK      GENMASK(15, 14)
+#define AR_HDR_PRIO_MASK         GENMASK(13, 12)
+#define AR_HDR_TYPE_MASK         GENMASK(10, 8)
+#define AR_HDR_FROM_CPU          BIT(6)
+#define AR_HDR_PORT_MASK         GENMASK(3, 0)
+
+/*
+ *  Switch tag format of a vnic_group.
+ *
+ *  rx_proto is the ether type the real device reports for tagged frames,
+ *  0 when every frame from the switch carries a header in front of the
+ *  addresses.  rx_pull is how many bytes behind skb->data, as left by
+ *  eth_type_trans() on the real device, must be linear before parse_port()
+ *  and strip() run.
+ *
+ *  parse_port() returns the ingress port or a negative value for frames
+ *  to drop, strip() removes the tags of that port in place and returns NULL
+ *  when it had to free the skb, insert() adds the egress tag built once by
+ *  build().  push() is insert() on a raw frame starting at data, for XDP
+ *  frames: the caller guarantees tag_len bytes in front of it, the new start
+ *  is returned.
+ *  Formats addressing a port map have build_map() for ports 0 .. map_ports - 1,
+ *  one copy of a flooded frame then reaches all of them.  tc_tag() sets the
+ *  switch traffic class (0-7) of a built tag.  max_ports is how many ports
+ *  the source port field can name, it sizes the port table of a group.
+ *
+ *  Switches in cascade stack their tags, so a built tag is a u64 holding
+ *  up to two of them, the outermost in the low half.  tag_len and rx_pull
+ *  then cover the whole stack and ports of the second switch are numbered
+ *  after those of the first.
+ *
+ *  rx_gro is set when the GRO of the real device looks through the tag,
+ *  the frames then come coalesced already.
+ */
+struct vnic_tag_ops {
+	const char *name;
+	unsigned char gid;
+	unsigned int tag_len;
+	unsigned int rx_pull;
+	__be16 rx_proto;
+	unsigned int max_ports;
+	bool rx_gro;
+
+	int (*parse_port)(const struct sk_buff *skb);
+	struct sk_buff *(*strip)(struct sk_buff *skb, unsigned int port);
+	u64 (*build)(unsigned int port);
+	int (*insert)(struct sk_buff *skb, u64 tag);
+	void *(*push)(void *data, u64 tag);
+
+	unsigned int map_ports;
+	u64 (*build_map)(u32 map);
+	u64 (*tc_tag)(u64 tag, unsigned int tc);
+};
+
+extern struct vnic_tag_ops vnic_brcm_tag_ops;
+extern const struct vnic_tag_ops vnic_ar_tag_ops;
+
+INDIRECT_CALLABLE_DECLARE(int vnic_brcm_parse_port(const struct sk_buff *skb));
+INDIRECT_CALLABLE_DECLARE(struct sk_buff *vnic_brcm_strip(struct sk_buff *skb, unsigned int port));
+INDIRECT_CALLABLE_DECLARE(int vnic_brcm_insert(struct sk_buff *skb, u64 tag));
+INDIRECT_CALLABLE_DECLARE(void *vnic_brcm_push(void *data, u64 tag));
+INDIRECT_CALLABLE_DECLARE(int vnic_ar_parse_port(const struct sk_buff *skb));
+INDIRECT_CALLABLE_DECLARE(struct sk_buff *vnic_ar_strip(struct sk_buff *skb, unsigned int port));
+INDIRECT_CALLABLE_DECLARE(int vnic_ar_insert(struct sk_buff *skb, u64 tag));
+INDIRECT_CALLABLE_DECLARE(void *vnic_ar_push(void *data, u64 tag));
+
+/*
+ * Per-packet dispatch.  Known formats are compared and called directly,
+ * so a group costs no retpoline; a new vendor only needs to be added here.
+ */
+#define VNIC_TAG_TCS 8
+
+#define vnic_tag_call(ops, fn, ...)						\
+	INDIRECT_CALL_2((ops)->fn, vnic_brcm_##fn, vnic_ar_##fn, __VA_ARGS__)
+
+const struct vnic_tag_ops *vnic_tag_ops_get(unsigned char gid);
+int vnic_tag_init(void);
+void vnic_tag_fini(void);
+
+#if IS_ENABLED(CONFIG_KUNIT)
+unsigned int vnic_brcm_kunit_cascade(int port);
+#endif
+
+#endif
@@ -0,0 +1,141 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  vnic_trace.h
+ *
+ *    Description:  Tracepoints of the VNIC fast path (trace system "vnic")
+ *
+ * =====================================================================================
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM vnic
+
+#ifndef __VNIC_TRACE_ENUM__
+#define __VNIC_TRACE_ENUM__
+
+enum vnic_rx_drop_reason {
+	VNIC_RX_DROP_SHORT,	/* no complete tag in the frame            */
+	VNIC_RX_DROP_NO_PORT,	/* no virtual device for the tagged port   */
+	VNIC_RX_DROP_NOMEM,	/* clone or header unshare failed          */
+};
+
+#endif
+
+#if !defined(__VNIC_TRACE_INC__) || defined(TRACE_HEADER_MULTI_READ)
+#define __VNIC_TRACE_INC__
+
+#include <linux/netdevice.h>
+#include <linux/tracepoint.h>
+
+TRACE_DEFINE_ENUM(VNIC_RX_DROP_SHORT);
+TRACE_DEFINE_ENUM(VNIC_RX_DROP_NO_PORT);
+TRACE_DEFINE_ENUM(VNIC_RX_DROP_NOMEM);
+
+TRACE_EVENT(vnic_port_lookup,
+
+	TP_PROTO(const struct net_device *real_dev, int port,
+		 const struct net_device *vdev),
+
+	TP_ARGS(real_dev, port, vdev),
+
+	TP_STRUCT__entry(
+		__string(real_dev, real_dev->name)
+		__string(vdev, vdev ? vdev->name : "-")
+		__field(int, port)
+	),
+
+	TP_fast_assign(
+		__assign_str(real_dev);
+		__assign_str(vdev);
+		__entry->port = port;
+	),
+
+	TP_printk("real_dev=%s port=%d dev=%s",
+		  __get_str(real_dev), __entry->port, __get_str(vdev))
+);
+
+TRACE_EVENT(vnic_rx_demux,
+
+	TP_PROTO(const struct net_device *real_dev, const struct net_device *vdev,
+		 unsigned int port, unsigned int len),
+
+	TP_ARGS(real_dev, vdev, port, len),
+
+	TP_STRUCT__entry(
+		__string(real_dev, real_dev->name)
+		__string(vdev, vdev->name)
+		__field(unsigned int, port)
+		__field(unsigned int, len)
+	),
+
+	TP_fast_assign(
+		__assign_str(real_dev);
+		__assign_str(vdev);
+		__entry->port = port;
+		__entry->len  = len;
+	),
+
+	TP_printk("real_dev=%s port=%u dev=%s len=%u",
+		  __get_str(real_dev), __entry->port, __get_str(vdev), __entry->len)
+);
+
+TRACE_EVENT(vnic_rx_drop,
+
+	TP_PROTO(const struct net_device *real_dev, unsigned int port,
+		 enum vnic_rx_drop_reason reason),
+
+	TP_ARGS(real_dev, port, reason),
+
+	TP_STRUCT__entry(
+		__string(real_dev, real_dev->name)
+		__field(unsigned int, port)
+		__field(unsigned int, reason)
+	),
+
+	TP_fast_assign(
+		__assign_str(real_dev);
+		__entry->port   = port;
+		__entry->reason = reason;
+	),
+
+	TP_printk("real_dev=%s port=%u reason=%s",
+		  __get_str(real_dev), __entry->port,
+		  __print_symbolic(__entry->reason,
+				   { VNIC_RX_DROP_SHORT,   "short" },
+				   { VNIC_RX_DROP_NO_PORT, "no_port" },
+				   { VNIC_RX_DROP_NOMEM,   "nomem" }))
+);
+
+TRACE_EVENT(vnic_tx_tag,
+
+	TP_PROTO(const struct net_device *dev, const struct net_device *real_dev,
+		 u64 tag, unsigned int len),
+
+	TP_ARGS(dev, real_dev, tag, len),
+
+	TP_STRUCT__entry(
+		__string(dev, dev->name)
+		__string(real_dev, real_dev->name)
+		__field(u64, tag)
+		__field(unsigned int, len)
+	),
+
+	TP_fast_assign(
+		__assign_str(dev);
+		__assign_str(real_dev);
+		__entry->tag = tag;
+		__entry->len = len;
+	),
+
+	TP_printk("dev=%s real_dev=%s tag=%llx len=%u",
+		  __get_str(dev), __get_str(real_dev), __entry->tag, __entry->len)
+);
+
+#endif /* __VNIC_TRACE_INC__ */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE vnic_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,20 @@
+#ifndef __VNIC_XDP_INC__
+#define __VNIC_XDP_INC__
+
+#include <linux/types.h>
+
+/*
+ *  Shared with the XDP dispatcher (tools/vnic_xdp.bpf.c) attached to the
+ *  real device.  It strips the tag in the XDP buffer and tail-calls the
+ *  program of the ingress port.  A frame that is passed on keeps its port
+ *  in the XDP metadata, right in front of the Ethernet header, so
+ *  vnic_skb_recv() delivers it without parsing a tag again.
+ */
+#define VNIC_XDP_META_MAGIC   0x564e		/* "VN" */
+
+struct vnic_xdp_meta {
+	__u16 magic;
+	__u16 port;
+};
+
+#endif